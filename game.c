@@ -15,49 +15,87 @@
 #include "include/editor.h"
 #include "include/level.h"
 #include "include/math.h"
-
-static inline Olivec_Canvas do_render(buffer *buf, Olivec_Canvas oc, Light light, Level *level, Camera cam, float fps)
+#include "include/headless.h"
+#include "include/profile.h"
+#include "include/present.h"
+#include "include/pipeline.h"
+#include "include/pacing.h"
+#include "include/shadow.h"
+#include "include/lightmap.h"
+#include "include/scale.h"
+#include <poll.h>
+
+// The scene is drawn at the current render scale and upscaled into buf;
+// the HUD goes on top at buf's own resolution
+static inline Olivec_Canvas do_render(buffer *buf, Raster *rs, RenderScale *scale, Olivec_Canvas oc, Light light, Level *level, Camera cam)
 {
+    uint64_t begin = NANO();
+    buffer *target = scale_target(scale, buf);
     oc = olivec_canvas((uint32_t*)buf->mem, buf->w, buf->h, buf->w);
-    for (int i = 0; i < (int)(buf->w * buf->h); i++)
-        buf->depth_buffer[i] = 1.0f;
-
-    create_background(oc, g_fog_color);
-    create_floor(
-        buf,
-        oc,
-        100,
-        100,
-        100,
-        100,
-        0xFFaaefbb,
-        0xFF78de99,
-        light, cam);
-
-    level_render(level, buf, oc, light, cam);
-
-    char text[32];
-    snprintf(text, sizeof(text), "[fps]%.1f", fps);
-    place_text(oc, text);
+    View view = view_create(cam, target->w, target->h);
+
+    // The rasterizer clears color and, once per depth epoch, depth in one
+    // pass right before drawing
+    if (light.shadow)
+    {
+        PROFILE_SCOPE(PROFILE_SHADOW);
+        shadow_update(light.shadow, rs, level, light);
+    }
+    {
+        PROFILE_SCOPE(PROFILE_BAKE);
+        lightmap_update(level, light);
+    }
+
+    // Point lights may have moved since the last frame
+    lights_bin(&level->light_bins, level->lights, level->light_count);
+
+    raster_begin(rs, target);
+    raster_set_clear(rs, g_fog_color);
+    {
+        PROFILE_SCOPE(PROFILE_FLOOR);
+        create_floor(
+            rs,
+            100,
+            100,
+            100,
+            100,
+            0xFFaaefbb,
+            0xFF78de99,
+            light, &view, &level->light_bins,
+            level->ground_texture ? &level->textures[level->ground_texture - 1] : NULL);
+    }
+    {
+        PROFILE_SCOPE(PROFILE_LEVEL);
+        level_render(level, rs, light, &view);
+    }
+    {
+        PROFILE_SCOPE(PROFILE_RASTER);
+        raster_flush(rs);
+    }
+    if (target != buf)
+    {
+        PROFILE_SCOPE(PROFILE_UPSCALE);
+        scale_upscale(scale, target, buf);
+    }
+    rs->stats.render_w = target->w;
+    rs->stats.render_h = target->h;
+    scale_update(scale, NANO() - begin);
+    {
+        PROFILE_SCOPE(PROFILE_HUD);
+        profile_draw_hud(oc, &rs->stats, level->wall_count);
+    }
     return oc;
 }
 
-static inline Olivec_Canvas do_editor(buffer *buf, Olivec_Canvas oc, Level *level, Camera cam, EditorState* es, int mouse_x, int mouse_y)
+static inline Olivec_Canvas do_editor(buffer *buf, Raster *rs, RenderScale *scale, Olivec_Canvas oc, Light light, Level *level, Camera cam, EditorState* es, int mouse_x, int mouse_y)
 {
     // Get viewport layouts
     Viewport vp_3d, vp_2d, vp_info;
     get_editor_viewports(buf->w, buf->h, &vp_3d, &vp_2d, &vp_info);
     
     // First, render the full 3D scene (this fills the entire buffer)
-    Light sun = {
-        .position = {300, -100, 200},
-        .direction = {0.3f, 1.0f, 0.5f},
-        .color = 0xFFFFFFFF,
-        .intensity = 1.0f,
-        .is_directional = 0
-    };
-    
-    do_render(buf, oc, sun, level, cam, 0.0f);  // fps can be 0 in editor
+    do_render(buf, rs, scale, oc, light, level, cam);
+    PROFILE_SCOPE(PROFILE_EDITOR);
     
     // Now create canvas for drawing 2D editor UI on top
     oc = olivec_canvas((uint32_t*)buf->mem, buf->w, buf->h, buf->w);
@@ -75,7 +113,7 @@ static inline Olivec_Canvas do_editor(buffer *buf, Olivec_Canvas oc, Level *leve
     // Only check hover if mouse is in 2D viewport
     int hover_enabled = mouse_in_viewport(mouse_x, mouse_y, &vp_2d);
     
-    // Draw walls and compute hover
+    // Draw walls
     for (int i = 0; i < level->wall_count; ++i)
     {
         Wall *w = &level->walls[i];
@@ -92,34 +130,15 @@ static inline Olivec_Canvas do_editor(buffer *buf, Olivec_Canvas oc, Level *leve
         olivec_line(oc, sx0, sy0, sx1, sy1, 0xFFCC4A4A);
         olivec_rect(oc, sx0 - HR, sy0 - HR, 2*HR+1, 2*HR+1, 0xFF3B82F6);
         olivec_rect(oc, sx1 - HR, sy1 - HR, 2*HR+1, 2*HR+1, 0xFF3B82F6);
-        
-        if (hover_enabled) {
-            // Compute distance in viewport-relative coordinates
-            int local_mx = mouse_x - vp_2d.x;
-            int local_my = mouse_y - vp_2d.y;
-            int local_sx0 = sx0 - vp_2d.x;
-            int local_sy0 = sy0 - vp_2d.y;
-            int local_sx1 = sx1 - vp_2d.x;
-            int local_sy1 = sy1 - vp_2d.y;
-            
-            float vx = local_sx1 - local_sx0;
-            float vy = local_sy1 - local_sy0;
-            float wx = local_mx - local_sx0;
-            float wy = local_my - local_sy0;
-            float vv = vx*vx + vy*vy;
-            if (vv < 1e-6f) vv = 1.0f;
-            float t = fmaxf(0.0f, fminf(1.0f, (vx*wx + vy*wy) / vv));
-            float cx = local_sx0 + t * vx;
-            float cy = local_sy0 + t * vy;
-            float dx = local_mx - cx;
-            float dy = local_my - cy;
-            float dpx = sqrtf(dx*dx + dy*dy);
-            
-            if (dpx < best_px) {
-                best_px = dpx;
-                es->hovered_wall = i;
-            }
-        }
+    }
+
+    // Hover picks through the level's spatial grid instead of testing every wall
+    if (hover_enabled)
+    {
+        float mwx, mwz, dist;
+        screen_to_map_vp(es, &vp_2d, mouse_x, mouse_y, &mwx, &mwz);
+        es->hovered_wall = level_pick_wall(level, mwx, mwz, best_px / es->scale, &dist);
+        if (es->hovered_wall >= 0) best_px = dist * es->scale;
     }
     
     // Hover highlight
@@ -219,9 +238,203 @@ static inline Olivec_Canvas do_editor(buffer *buf, Olivec_Canvas oc, Level *leve
 //     place_text(oc, text);
 // }
 
-int main()
+static inline int do_headless(const HeadlessOptions *opt)
+{
+    buffer buf = {};
+    buf.w = opt->width;
+    buf.h = opt->height;
+    buf.pitch = buf.w * 4;
+    buf.size = (uint64_t)buf.pitch * buf.h;
+    buf.mem = (uint8_t *)malloc(buf.size);
+    buf.depth_buffer = (float *)malloc(sizeof(float) * buf.w * buf.h);
+
+    Light sun = {};
+    sun.position = (Vec3){300, -100, 200};
+    sun.direction = (Vec3){0.3f, 1.0f, 0.5f};
+    sun.color = 0xFFFFFFFF;
+    sun.intensity = 1.0f;
+    sun.is_directional = 0;
+
+    CameraPath path = {};
+    if (opt->path && !camera_path_load(opt->path, &path)) return 1;
+
+    Level* level = opt->stress ? level_generate(opt->stress, 1) : level_load_from_file(opt->level);
+    level->lightmap.enabled = !opt->no_bake;
+    Olivec_Canvas oc = {};
+    Raster rs;
+    raster_init(&rs);
+    rs.shade = opt->shade;
+    rs.depth_test = !opt->no_depth_test;
+    ShadowMap shadow;
+    shadow_init(&shadow, opt->shadow);
+    sun.shadow = &shadow;
+    RenderScale scale;
+    scale_init(&scale, opt->scale != 0.0f ? opt->scale : 1.0f, opt->target_ms, opt->upscale);
+
+    // Warmup frames replay the start of the path and are neither timed nor written
+    int warmup = opt->bench ? opt->warmup : 0;
+    for (int i = 0; i < warmup; i++)
+    {
+        Camera cam = opt->path ? camera_path_sample(&path, i % opt->frames, opt->frames) : opt->camera;
+        oc = do_render(&buf, &rs, &scale, oc, sun, level, cam);
+    }
+
+    // Timings in headless frames vary run to run, so the HUD is opt-in here
+    g_profiler.hud = opt->hud;
+
+    uint64_t *times = (uint64_t *)malloc(sizeof(uint64_t) * opt->frames);
+    uint64_t total = 0;
+    uint64_t submitted = 0, rasterized = 0, shaded = 0, culled = 0, blocks = 0;
+    double scaled = 0.0;
+    for (int i = 0; i < opt->frames; i++)
+    {
+        Camera cam = opt->path ? camera_path_sample(&path, i, opt->frames) : opt->camera;
+
+        profile_frame_begin();
+        uint64_t begin = NANO();
+        oc = do_render(&buf, &rs, &scale, oc, sun, level, cam);
+        times[i] = NANO() - begin;
+        profile_frame_end(&rs.stats);
+        total += times[i];
+
+        submitted += rs.stats.tris_submitted;
+        rasterized += rs.stats.tris_rasterized;
+        shaded += rs.stats.pixels_shaded;
+        culled += rs.stats.objects_culled;
+        blocks += rs.stats.blocks_culled;
+        scaled += (double)rs.stats.render_w / buf.w;
+        if (opt->bench) continue;
+
+        char filename[512];
+        snprintf(filename, sizeof(filename), "%s_%04d.%s", opt->out, i, opt->raw ? "raw" : "ppm");
+        int ok = opt->raw ? write_raw(&buf, filename) : write_ppm(&buf, filename);
+        if (!ok)
+        {
+            printf("[ERROR] Couldn't write %s\n", filename);
+            break;
+        }
+    }
+
+    if (opt->bench)
+    {
+        // One JSON object per line; counters are per-frame averages
+        double n = (double)opt->frames;
+        qsort(times, opt->frames, sizeof(uint64_t), headless_cmp_u64);
+        printf("{\"level\":\"%s\",\"walls\":%d,\"path\":\"%s\",\"width\":%d,\"height\":%d,"
+            "\"threads\":%d,\"frames\":%d,\"min_ms\":%.3f,\"median_ms\":%.3f,\"p99_ms\":%.3f,"
+            "\"mean_ms\":%.3f,\"tris_submitted\":%.1f,\"tris_rasterized\":%.1f,"
+            "\"pixels_shaded\":%.1f,\"walls_culled\":%.1f,\"blocks_culled\":%.1f,\"scale\":%.3f}\n",
+            opt->stress ? "stress" : opt->level, level->wall_count, opt->path ? opt->path : "",
+            buf.w, buf.h, rs.worker_count + 1, opt->frames,
+            headless_percentile(times, opt->frames, 0.0),
+            headless_percentile(times, opt->frames, 0.5),
+            headless_percentile(times, opt->frames, 0.99),
+            (double)total / 1e6 / n,
+            submitted / n, rasterized / n, shaded / n, culled / n, blocks / n, scaled / n);
+    }
+    else
+    {
+        printf("[LOG] Rendered %d frames at %dx%d, %.2f ms avg\n",
+            opt->frames, buf.w, buf.h, (double)total / 1e6 / opt->frames);
+    }
+
+    free(times);
+    profile_trace_close();
+    raster_free(&rs);
+    shadow_free(&shadow);
+    scale_free(&scale);
+    level_free(level);
+    camera_path_free(&path);
+    free(buf.mem);
+    free(buf.depth_buffer);
+    return 0;
+}
+
+// Everything the render thread reads from main; guarded by the scene lock
+typedef struct
+{
+    Pipeline *pl;
+    Raster *rs;
+    Level *level;
+    Camera *cam;
+    KeyState *keys;
+    EditorState *es;
+    RenderScale *scale;
+    Light sun;
+    PaceMode pace;
+    int fps;
+    int *editor;
+    int *mouse_x;
+    int *mouse_y;
+}
+RenderContext;
+
+static void *render_thread(void *arg)
+{
+    RenderContext *rc = (RenderContext *)arg;
+    Olivec_Canvas oc = {};
+
+    FrameLimiter limiter;
+    limiter_init(&limiter, rc->pace, rc->fps);
+    FixedStep sim;
+    fixed_step_init(&sim);
+    Camera prev = *rc->cam;
+
+    for (;;)
+    {
+        // Frames are timed from here so pacing and waiting for a slot count too
+        profile_frame_begin();
+        int slot;
+        {
+            PROFILE_SCOPE(PROFILE_PACING);
+            limiter_wait(&limiter);
+            slot = pipeline_acquire(rc->pl);
+        }
+        if (slot < 0) break;
+        buffer *buf = &rc->pl->slots[slot].buf;
+
+        pthread_mutex_lock(&rc->pl->scene);
+
+        // Input is sampled right before drawing; the camera then catches up
+        // in fixed steps and is drawn between its last two states
+        int steps = fixed_step_advance(&sim);
+        for (int i = 0; i < steps; i++)
+        {
+            prev = *rc->cam;
+            update_camera(rc->cam, rc->keys, (float)(DELTA_TIME / 1e9));
+        }
+        Camera cam = camera_lerp(prev, *rc->cam, sim.alpha);
+
+        if (!*rc->editor) oc = do_render(buf, rc->rs, rc->scale, oc, rc->sun, rc->level, cam);
+        if ( *rc->editor) oc = do_editor(buf, rc->rs, rc->scale, oc, rc->sun, rc->level, cam, rc->es, *rc->mouse_x, *rc->mouse_y);
+        pthread_mutex_unlock(&rc->pl->scene);
+
+        pipeline_submit(rc->pl, slot);
+        profile_frame_end(&rc->rs->stats);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
 {
+    HeadlessOptions headless;
+    if (!headless_parse(argc, argv, &headless))
+    {
+        printf("[ERROR] Usage: %s [--headless] [--frames N] [--size WxH] [--level file | --stress N] "
+            "[--camera x,y,z,ax,ay | --path file] [--out prefix] [--raw] [--bench] [--warmup N] [--hud] [--trace file] [--no-shm] [--buffers 2|3] [--fps N] [--vsync] [--shade flat|vertex|pixel] [--no-fog] [--no-light] [--no-depth-test] [--shadow N] [--no-bake] [--scale F|auto] [--target-ms N] [--upscale nearest|bilinear|edge]\n", argv[0]);
+        return 1;
+    }
+    g_fog_active = !headless.no_fog;
+    g_light_active = !headless.no_light;
+    if (headless.trace && !profile_trace_open(headless.trace)) return 1;
+    if (headless.enabled) return do_headless(&headless);
+
     Display* disp = XOpenDisplay(0);
+    if (!disp)
+    {
+        printf("[ERROR] Couldn't open X display, use --headless to render without one\n");
+        return 1;
+    }
     Window root = XDefaultRootWindow(disp);
     int def_screen = DefaultScreen(disp);
     GC ctx = XDefaultGC(disp, def_screen);
@@ -267,16 +480,12 @@ int main()
         printf("[ERROR] Couldn't register WM_DELETE_WINDOW property \n");
     }
 
-    int bpp = 32;
-    int bytes_per_px = bpp / 8;
+    Presenter present;
+    present_init(&present, disp, win, ctx, vis_info, !headless.no_shm);
 
-    buffer buf = {};
-    buf.w = win_w;
-    buf.h = win_h;
-    buf.pitch = buf.w * bytes_per_px;
-    buf.size = buf.pitch * buf.h;
-    buf.mem = (uint8_t *)malloc(buf.size);
-    buf.depth_buffer = (float *)malloc(sizeof(float) * buf.w * buf.h);
+    Pipeline pl;
+    pipeline_init(&pl, headless.buffers);
+    pipeline_attach(&pl, &present, win_w, win_h);
 
     Camera cam = {};
     cam.distance = 300.0f;
@@ -294,38 +503,83 @@ int main()
     sun.is_directional = 0;
 
     KeyState keys = {};
-    Olivec_Canvas oc = {};
 
-    XImage *img =
-        XCreateImage(disp, vis_info.visual, vis_info.depth,
-            ZPixmap, 0, (char *)buf.mem,
-            win_w, win_h, bpp, 0);
+    Raster rs;
+    raster_init(&rs);
+    rs.shade = headless.shade;
+    rs.depth_test = !headless.no_depth_test;
+    ShadowMap shadow;
+    shadow_init(&shadow, headless.shadow);
+    sun.shadow = &shadow;
+    RenderScale scale;
+    scale_init(&scale, headless.scale != 0.0f ? headless.scale : SCALE_AUTO, headless.target_ms, headless.upscale);
 
-    Level* level = level_load_from_file("level.txt");
+    Level* level = headless.stress ? level_generate(headless.stress, 1) : level_load_from_file(headless.level);
+    level->lightmap.enabled = !headless.no_bake;
 
     EditorState es = {0};
     es.snap_active = 0;
     es.snap_size   = 10.0f; 
     if (es.snap_size < 1e-3f) es.snap_size = 1e-3f;
     es.viewport_focused = 1;
-    editor_fit_level(&es, &buf, level);
-
-    uint64_t end = NANO();
-    float fps = 0.0f;
-    float fps_update_timer = 0.0f;
-    const float FPS_UPDATE_INTERVAL = 0.1f;
+    editor_fit_level(&es, &pl.slots[0].buf, level);
 
     int is_open = 1;
     int editor = 0;
     int mouse_x = 0, mouse_y = 0;
     int dragging_active = 0;
 
+    PaceMode pace = headless.vsync ? PACE_PRESENT : (headless.fps > 0 ? PACE_CAPPED : PACE_UNCAPPED);
+    pl.fifo = (pace == PACE_PRESENT);
+
+    RenderContext render_ctx = { &pl, &rs, level, &cam, &keys, &es, &scale, sun, pace, headless.fps, &editor, &mouse_x, &mouse_y };
+    pthread_t render;
+    pthread_create(&render, NULL, render_thread, &render_ctx);
+    printf("[LOG] Rendering on its own thread into %d buffers\n", pl.slot_count);
+
+    // This thread handles X events and presentation while frames render
+    int x_fd = ConnectionNumber(disp);
     while(is_open)
     {
+        if (XPending(disp) == 0)
+        {
+            struct pollfd fds[2] = { { x_fd, POLLIN, 0 }, { pl.wake[0], POLLIN, 0 } };
+            poll(fds, 2, -1);
+        }
+
+        // Show the newest finished frame before anything else
+        int shown = pipeline_take(&pl);
+        if (shown >= 0)
+        {
+            uint64_t begin = NANO();
+            FrameSlot *slot = &pl.slots[shown];
+            if (!present_frame(&present, &slot->image, slot->buf.w, slot->buf.h))
+                pipeline_release(&pl, shown);
+            profile_add(PROFILE_PRESENT, NANO() - begin);
+        }
+
+        if (XPending(disp) == 0) continue;
+
+        uint64_t events_begin = NANO();
+        int resized = 0;
+        pipeline_set_input(&pl, 1);
+        pthread_mutex_lock(&pl.scene);
         while(XPending(disp) > 0)
         {
             XEvent ev = (XEvent){0};
             XNextEvent(disp, &ev);
+
+            ShmSeg seg = present_completed(&present, &ev);
+            if (seg)
+            {
+                for (int i = 0; i < pl.slot_count; i++)
+                {
+                    if (pl.slots[i].image.shm.shmseg != seg) continue;
+                    pl.slots[i].image.pending = 0;
+                    pipeline_release(&pl, i);
+                }
+                continue;
+            }
             switch(ev.type)
             {
                 case ClientMessage:
@@ -338,6 +592,21 @@ int main()
                     XKeyPressedEvent *key_ev = (XKeyPressedEvent *)&ev;
                     KeySym keysym = XLookupKeysym(key_ev, 0);
                     if (keysym == XK_F1) editor = editor ? 0 : 1;
+                    if (keysym == XK_F3) rs.shade = (ShadeMode)((rs.shade + 1) % 3);
+                    if (keysym == XK_F4) g_fog_active = !g_fog_active;
+                    if (keysym == XK_F5) g_light_active = !g_light_active;
+                    if (keysym == XK_F6) rs.depth_test = !rs.depth_test;
+                    if (keysym == XK_F7) shadow.enabled = shadow.size > 0 && !shadow.enabled;
+                    if (keysym == XK_F8) level->lightmap.enabled = !level->lightmap.enabled;
+                    if (keysym == XK_F9) scale.filter = (UpscaleFilter)((scale.filter + 1) % UPSCALE_FILTER_COUNT);
+                    if (keysym == XK_F10)
+                    {
+                        // Back to full resolution when switched off
+                        scale.automatic = !scale.automatic;
+                        scale.samples = 0;
+                        if (!scale.automatic) scale.scale = 1.0f;
+                    }
+                    if (keysym == XK_F11) g_profiler.hud = !g_profiler.hud;
                     if (keysym == XK_Escape) is_open = 0;
                     if (!editor) 
                     {
@@ -377,7 +646,7 @@ int main()
                             if (keysym == XK_o)     es.scale = fminf(es.scale * 1.1f, 4096.0f);
                             if (keysym == XK_p)     es.scale = fmaxf(es.scale / 1.1f, 0.01f);
                             if (keysym == XK_w) {   es.mode = EMode_NewWall; es.started = 0; }
-                            if (keysym == XK_s) {   level_save_to_file(level, "level.txt"); printf("[LOG] Level saved"); }
+                            if (keysym == XK_s) {   level_save_to_file(level, headless.level); printf("[LOG] Level saved"); }
                             if (keysym == XK_Escape) 
                             { 
                                 es.mode = EMode_Default; 
@@ -395,8 +664,12 @@ int main()
                                 int shift_down = (mods & ShiftMask) != 0;
                                 Wall* w = &level->walls[target];
 
+                                // Only edits mark the wall dirty; pan, zoom and the
+                                // other keys leave it as it is
+                                int changed = 0;
+
                                 // Toggle culling with 'c'
-                                if (keysym == XK_c || keysym == XK_C) w->flip_culling ^= 1;
+                                if (keysym == XK_c || keysym == XK_C) { w->flip_culling ^= 1; changed = 1; }
             
                                 // Height adjust: PgUp/PgDn or +/- keys
                                 float h_step = 1.0f;
@@ -406,11 +679,13 @@ int main()
                                         keysym == XK_KP_Add) 
                                     {
                                         w->height = fminf(w->height + h_step, 10000.0f);
+                                        changed = 1;
                                     }
                                     if (keysym == XK_minus || 
                                         keysym == XK_KP_Subtract)
                                     {
                                         w->height = fmaxf(w->height - h_step, 0.1f);
+                                        changed = 1;
                                     }
                                 }
                                 // Shift-modified +/-: move wall vertically (Y)
@@ -422,13 +697,16 @@ int main()
                                         keysym == XK_KP_Add) 
                                     {
                                         w->pos.y = fminf(w->pos.y - h_step, 10000.0f);
+                                        changed = 1;
                                     }
                                     if (keysym == XK_minus || 
                                         keysym == XK_KP_Subtract) 
                                     {
                                         w->pos.y = fmaxf(w->pos.y + h_step, -10000.0f);
+                                        changed = 1;
                                     }
                                 }
+                                if (changed) level_mark_dirty(level, target);
                             }
                         }
                     }
@@ -471,29 +749,11 @@ int main()
                 case ConfigureNotify:
                 {
                     XConfigureEvent *cfg_ev = (XConfigureEvent *)&ev;
+                    // Moves report the same size; don't rebuild the image for those
+                    if (cfg_ev->width == win_w && cfg_ev->height == win_h) break;
                     win_w = cfg_ev->width;
                     win_h = cfg_ev->height;
-
-                    XDestroyImage(img);
-                    free(buf.depth_buffer);
-
-                    buf.w = win_w;
-                    buf.h = win_h;
-                    buf.pitch = buf.w * bytes_per_px;
-                    buf.size = buf.pitch * buf.h;
-                    buf.mem = (uint8_t *)malloc(buf.size);
-                    buf.depth_buffer = (float *)malloc(sizeof(float) * buf.w * buf.h);
-
-                    img = XCreateImage(
-                        disp,
-                        vis_info.visual,
-                        vis_info.depth,
-                        ZPixmap,
-                        0,
-                        (char *)buf.mem,
-                        win_w, win_h,
-                        bpp,
-                        0);
+                    resized = 1;
                 } break;
 
                 case MotionNotify:
@@ -503,7 +763,7 @@ int main()
                     
                     if (editor) {
                         Viewport vp_3d, vp_2d, vp_info;
-                        get_editor_viewports(buf.w, buf.h, &vp_3d, &vp_2d, &vp_info);
+                        get_editor_viewports(win_w, win_h, &vp_3d, &vp_2d, &vp_info);
                         
                         if (es.mode == EMode_DragWall && es.drag_wall >= 0)
                         {
@@ -532,6 +792,7 @@ int main()
                                 }
                                 level->walls[es.drag_wall].pos.x += dx;
                                 level->walls[es.drag_wall].pos.z += dz;
+                                level_mark_dirty(level, es.drag_wall);
                                 last_x = mouse_x;
                                 last_y = mouse_y;
                             }
@@ -566,6 +827,7 @@ int main()
                                 level->walls[es.drag_wall].height, 
                                 level->walls[es.drag_wall].color, 
                                 &level->walls[es.drag_wall]);
+                            level_mark_dirty(level, es.drag_wall);
                         }
                     }
                 } break;
@@ -578,7 +840,7 @@ int main()
                     
                     // Get viewports to check which one was clicked
                     Viewport vp_3d, vp_2d, vp_info;
-                    get_editor_viewports(buf.w, buf.h, &vp_3d, &vp_2d, &vp_info);
+                    get_editor_viewports(win_w, win_h, &vp_3d, &vp_2d, &vp_info);
                     
                     // Set focus based on click location
                     if (mouse_in_viewport(mouse_x, mouse_y, &vp_3d)) {
@@ -615,7 +877,7 @@ int main()
                                     sx = snapf(sx, es.snap_size); 
                                     sz = snapf(sz, es.snap_size); 
                                 }
-                                Wall nw; endpoints_to_wall(sx,sz, wx,wz, 40.0f, 0xFFCC4A4A, &nw);
+                                Wall nw = {}; endpoints_to_wall(sx,sz, wx,wz, 40.0f, 0xFFCC4A4A, &nw);
                                 level_add_wall(level, nw);
                                 es.started=0; es.mode=EMode_Default;
                             }
@@ -672,25 +934,27 @@ int main()
             }
         }
 
-        uint64_t begin = NANO();
-        uint64_t delta = begin - end;
-        end = begin;
-        float dt = (float)delta / 1e9f;
+        pthread_mutex_unlock(&pl.scene);
+        pipeline_set_input(&pl, 0);
+        profile_add(PROFILE_EVENTS, NANO() - events_begin);
 
-        fps_update_timer += dt;
-        if (fps_update_timer >= FPS_UPDATE_INTERVAL)
+        if (resized)
         {
-            fps = 1.0f / dt;
-            fps_update_timer = 0.0f;
+            // Rebuild every slot at the new size between two frames
+            pipeline_pause(&pl);
+            pipeline_detach(&pl, &present);
+            pipeline_attach(&pl, &present, win_w, win_h);
+            pipeline_resume(&pl);
         }
-
-        update_camera(&cam, &keys, dt);
-
-        if (!editor) oc = do_render(&buf, oc, sun, level, cam, fps);
-        if ( editor) oc = do_editor(&buf, oc, level, cam, &es, mouse_x, mouse_y);
-
-        XPutImage(disp, win, ctx, img, 0, 0, 0, 0, win_w, win_h);
     } // while(is_open)
 
+    pipeline_quit(&pl);
+    pthread_join(render, NULL);
+    profile_trace_close();
+    pipeline_detach(&pl, &present);
+    pipeline_free(&pl);
+    raster_free(&rs);
+    shadow_free(&shadow);
+    scale_free(&scale);
     return 0;
 }
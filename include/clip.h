@@ -0,0 +1,76 @@
+#ifndef CLIP_H
+#define CLIP_H
+
+#include "game.h"
+#include "math.h"
+
+// Positive on the kept side of the plane
+static inline float plane_distance(Plane plane, Vec3 p)
+{
+    return vec3_dot(plane.normal, p) - plane.distance;
+}
+
+// Bit i set when p lies outside planes[i]
+static inline int clip_outcode(const Plane *planes, int count, Vec3 p)
+{
+    int code = 0;
+    for (int i = 0; i < count; i++)
+        if (plane_distance(planes[i], p) < 0.0f) code |= 1 << i;
+    return code;
+}
+
+// Conservative box test: checks only the corner furthest along each normal
+static inline int aabb_outside_planes(const Plane *planes, int count, Vec3 lo, Vec3 hi)
+{
+    for (int i = 0; i < count; i++)
+    {
+        Vec3 n = planes[i].normal;
+        Vec3 p = {
+            n.x >= 0.0f ? hi.x : lo.x,
+            n.y >= 0.0f ? hi.y : lo.y,
+            n.z >= 0.0f ? hi.z : lo.z
+        };
+        if (plane_distance(planes[i], p) < 0.0f) return 1;
+    }
+    return 0;
+}
+
+// Sutherland-Hodgman against one plane. A convex polygon gains at most one
+// vertex per plane, so a triangle clipped to the view planes fits MAX_POLY_VERTS.
+static inline void polygon_clip(Polygon *poly, Plane plane)
+{
+    Polygon out;
+    out.num_vertices = 0;
+
+    int n = poly->num_vertices;
+    for (int i = 0; i < n; i++)
+    {
+        Vec3 cur = poly->vertices[i];
+        Vec3 next = poly->vertices[(i + 1) % n];
+        float dc = plane_distance(plane, cur);
+        float dn = plane_distance(plane, next);
+
+        if (dc >= 0.0f && out.num_vertices < MAX_POLY_VERTS)
+            out.vertices[out.num_vertices++] = cur;
+
+        if ((dc >= 0.0f) != (dn >= 0.0f) && out.num_vertices < MAX_POLY_VERTS)
+        {
+            float t = dc / (dc - dn);
+            Vec3 p = {
+                lerp(cur.x, next.x, t),
+                lerp(cur.y, next.y, t),
+                lerp(cur.z, next.z, t)
+            };
+            out.vertices[out.num_vertices++] = p;
+        }
+    }
+    *poly = out;
+}
+
+static inline void polygon_clip_planes(Polygon *poly, const Plane *planes, int mask)
+{
+    for (int i = 0; mask && poly->num_vertices >= 3; i++, mask >>= 1)
+        if (mask & 1) polygon_clip(poly, planes[i]);
+}
+
+#endif // CLIP_H
@@ -12,7 +12,7 @@
 
 #define FPS 60
 #define STATUS_ERROR 0
-#define DELTA_TIME 1e9/FPS
+#define DELTA_TIME (1e9 / FPS)
 
 #define Z_NEAR 0.1f
 #define Z_FAR 1000.0f
@@ -20,8 +20,17 @@
 #define MAX_POLY_VERTS 10
 #define MAX_TRIANGLES 1028
 
-#define g_light_active
-#define g_fog_active
+// Switched at runtime; the rasterizer picks span kernels specialized for
+// the current combination, so the pixel loops never test these
+static int g_light_active = 1;
+static int g_fog_active = 1;
+
+#define g_raster_subpixel_bits 4
+
+// Pixels past each screen edge that projected geometry may reach before it
+// is clipped; keeps edge setup small without clipping every border triangle
+#define g_guard_band 512.0f
+#define VIEW_CLIP_PLANES 6
 
 #define g_fog_start 400.0f
 #define g_fog_end 1000.0f
@@ -29,6 +38,10 @@
 
 typedef enum { FLOOR, WALL_X, WALL_Z } RectType;
 
+// Flat: lighting and fog once per triangle. Vertex: both per vertex and
+// interpolated. Pixel: lighting per vertex, fog per pixel from a table.
+typedef enum { SHADE_FLAT, SHADE_VERTEX, SHADE_PIXEL } ShadeMode;
+
 typedef struct
 {
     float x;
@@ -60,11 +73,36 @@ typedef struct
 }
 buffer;
 
+// Power-of-two texture with its mip chain, built by texture.h. Each level
+// is stored in TEXTURE_BLOCK x TEXTURE_BLOCK texel blocks, row by row, so
+// the 16 texels of a block share one cache line and a texel's neighbours
+// in either direction are usually in the same line.
+#define TEXTURE_BLOCK 4
+#define TEXTURE_MAX_LEVELS 12
+#define TEXTURE_NAME 32
+
+typedef struct
+{
+    char name[TEXTURE_NAME];
+    int w_log2;
+    int h_log2;
+    int levels;    // down to the first level with a side of TEXTURE_BLOCK
+    uint32_t *texels;
+    int offset[TEXTURE_MAX_LEVELS];
+}
+Texture;
+
 typedef struct
 {
     Vec3 tri[3];
-    uint32_t color;
+    uint32_t color[3];
+    float fog[3];
     float depth;
+
+    // Textured triangles: texture coordinates in repeats, and the texture
+    // the colors modulate; NULL for plain ones
+    Vec2 uv[3];
+    const Texture *texture;
 }
 RenderTri;
 
@@ -90,14 +128,156 @@ typedef struct
     RectType type;
     uint32_t color;
     int flip_culling;
+    int texture;   // 1 + index into the level's textures, 0 for none
 }
 Wall;
 
+// Uniform grid over the XZ plane, hashed into a fixed bucket table so the
+// level can grow in any direction. Buckets only hold candidates (different
+// cells may share a bucket); queries always do the exact test themselves.
+#define GRID_CELL_SIZE 128.0f
+#define GRID_BUCKETS 1024
+
+typedef struct
+{
+    int *items;
+    int count;
+    int capacity;
+}
+GridBucket;
+
+typedef struct
+{
+    int x0, z0;
+    int x1, z1;
+    int inserted;
+}
+GridSpan;
+
+typedef struct
+{
+    GridBucket buckets[GRID_BUCKETS];
+    GridSpan *spans;     // cell range each wall was inserted with
+    uint32_t *stamp;     // last query that visited each wall
+    uint32_t query;
+    int capacity;
+    float min_y;
+    float max_y;
+}
+Grid;
+
+// Baked world-space quads: 4 corners per quad in verts, plus a scratch
+// array the view transform writes camera-space corners into each frame
+typedef struct
+{
+    Vec3 *verts;
+    Vec3 *cam_verts;
+    Vec3 *bounds;  // min, max per quad
+    Vec3 *normals;
+    uint32_t *colors;
+    int *textures; // as Wall.texture
+    int quad_count;
+    int quad_capacity;
+}
+Mesh;
+
+// Point light placed in the level file. It adds diffuse light falling off
+// to nothing at radius and casts no shadows.
+typedef struct
+{
+    Vec3 position;
+    float radius;
+    uint32_t color;
+    float intensity;
+}
+PointLight;
+
+// Point lights binned every frame (lights.h): by the grid buckets of the
+// cells their radius overlaps, so walls only visit the lights of their own
+// cells, and by the floor tiles they reach
+typedef struct
+{
+    const PointLight *lights;
+    int light_count;
+    int offsets[GRID_BUCKETS + 1]; // bucket b holds items[offsets[b]..offsets[b + 1])
+    int *items;
+    int item_capacity;
+    uint32_t *stamp;    // last gather that visited each light
+    uint32_t query;
+    int stamp_capacity;
+
+    int tiles_x;
+    int *tile_offsets;  // tile iz * tiles_x + ix holds tile_items[tile_offsets[t]..tile_offsets[t + 1])
+    int tile_capacity;
+    int *tile_items;
+    int tile_item_capacity;
+}
+LightBins;
+
+// Lights reaching one wall or tile: indices into lights
+typedef struct
+{
+    const PointLight *lights;
+    const int *index;
+    int count;
+}
+LightList;
+
+// Light baked into the walls by lightmap.h: the lit color, before fog, at
+// each quad's corners and the centers of its two triangles, with shadows
+// and ambient occlusion. Valid for one light; walls rebuilt since the last
+// bake are queued in moved (old and new bounds) so only quads they can
+// affect are baked again.
+#define LIGHTMAP_SAMPLES 6
+
+typedef struct
+{
+    uint32_t *colors;   // LIGHTMAP_SAMPLES per quad
+    uint8_t *stale;
+    int stale_count;
+    int capacity;
+    int enabled;
+    int valid;
+
+    Vec3 *moved;        // min, max per rebuilt wall
+    int moved_count;
+    int moved_capacity;
+
+    // What the colors were baked for
+    Vec3 light_position;
+    Vec3 light_direction;
+    uint32_t light_color;
+    float light_intensity;
+    int light_directional;
+    int shadows;
+}
+Lightmap;
+
 typedef struct
 {
     Wall* walls;
     int wall_count;
     int wall_capacity;
+
+    Mesh mesh;     // one quad per wall, same index
+    uint8_t *dirty;
+    int dirty_count;
+
+    Grid grid;     // spatial index over the baked wall bounds
+    uint32_t revision; // bumped on every change, for caches built from the walls
+    int *visible;  // scratch for frustum and lightmap queries
+
+    Lightmap lightmap;
+
+    PointLight *lights;
+    int light_count;
+    int light_capacity;
+    LightBins light_bins;
+
+    Texture *textures;
+    int texture_count;
+    int texture_capacity;
+    int ground_texture; // as Wall.texture
 }
 Level;
 
@@ -131,6 +311,74 @@ typedef struct
 }
 Plane;
 
+// Per-frame view state: world->camera rotation rows plus translation, the
+// projection constants, and the camera-space planes triangles are clipped to
+typedef struct
+{
+    float m[3][4];
+    Vec3 eye;
+    float focal_length;
+    float center_x;
+    float center_y;
+    Plane clip[VIEW_CLIP_PLANES];
+    Plane frustum[6]; // world space: near, far, left, right, top, bottom
+    Vec3 frustum_lo;  // world-space bounds of the frustum
+    Vec3 frustum_hi;
+}
+View;
+
+typedef struct
+{
+    int objects_tested;
+    int objects_culled;
+    int tris_submitted;
+    int tris_rasterized;
+    int pixels_shaded;
+    int blocks_culled;
+
+    // Size the scene was drawn at before upscaling
+    int render_w;
+    int render_h;
+}
+FrameStats;
+
+#define SHADOW_DEFAULT_SIZE 512
+#define SHADOW_MAX_FACES 5
+#define SHADOW_BLOCK 16
+
+// Depth of the level as seen from a light, rendered by shadow_update and
+// sampled while lighting. Directional lights get one orthographic face over
+// the level (light_space); point lights get the five 90 degree faces of a
+// cube map that look down and sideways, nothing above them is shadowed.
+// Faces are stacked vertically in target, whose depth_buffer aliases the
+// map in shadow_depth; size is the resolution of one face.
+typedef struct
+{
+    buffer target;
+    int size;
+    int faces;
+    int enabled;
+    int valid;
+    int perspective;
+    Vec3 origin;
+    Vec3 axis[SHADOW_MAX_FACES][3]; // right, up, and forward away from the light
+    float scale;                    // texels per unit, or the focal length in texels
+    float depth_scale;              // orthographic only
+
+    // Nearest and farthest depth around each SHADOW_BLOCK square of texels,
+    // so receivers clear of every edge skip the texels themselves
+    float *coarse;
+    int blocks;
+
+    // What the map was last rendered for
+    Vec3 light_position;
+    Vec3 light_direction;
+    int light_directional;
+    const void *level;
+    uint32_t level_revision;
+}
+ShadowMap;
+
 typedef struct
 {
     Vec3 position;
@@ -138,6 +386,7 @@ typedef struct
     uint32_t color;
     float intensity;
     int is_directional;
+    ShadowMap *shadow;  // NULL when the light casts no shadows
 }
 Light;
 
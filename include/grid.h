@@ -0,0 +1,121 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include "game.h"
+
+static inline int grid_cell(float v)
+{
+    return (int)floorf(v / GRID_CELL_SIZE);
+}
+
+static inline int grid_hash(int cx, int cz)
+{
+    uint32_t h = ((uint32_t)cx * 73856093u) ^ ((uint32_t)cz * 19349663u);
+    return h & (GRID_BUCKETS - 1);
+}
+
+static inline GridBucket *grid_bucket(Grid *grid, int cx, int cz)
+{
+    return &grid->buckets[grid_hash(cx, cz)];
+}
+
+static inline void grid_init(Grid *grid)
+{
+    *grid = (Grid){0};
+    grid->min_y = 1e9f;
+    grid->max_y = -1e9f;
+}
+
+static inline void grid_free(Grid *grid)
+{
+    for (int i = 0; i < GRID_BUCKETS; i++)
+        free(grid->buckets[i].items);
+    free(grid->spans);
+    free(grid->stamp);
+    *grid = (Grid){0};
+}
+
+static inline void grid_reserve(Grid *grid, int count)
+{
+    if (count <= grid->capacity) return;
+    int capacity = grid->capacity ? grid->capacity : 16;
+    while (capacity < count) capacity *= 2;
+    grid->spans = (GridSpan *)realloc(grid->spans, sizeof(GridSpan) * capacity);
+    grid->stamp = (uint32_t *)realloc(grid->stamp, sizeof(uint32_t) * capacity);
+    for (int i = grid->capacity; i < capacity; i++)
+    {
+        grid->spans[i] = (GridSpan){0};
+        grid->stamp[i] = 0;
+    }
+    grid->capacity = capacity;
+}
+
+static inline void grid_remove(Grid *grid, int index)
+{
+    GridSpan *s = &grid->spans[index];
+    if (!s->inserted) return;
+    for (int cz = s->z0; cz <= s->z1; cz++)
+    {
+        for (int cx = s->x0; cx <= s->x1; cx++)
+        {
+            GridBucket *b = grid_bucket(grid, cx, cz);
+            for (int i = 0; i < b->count; i++)
+            {
+                if (b->items[i] != index) continue;
+                b->items[i] = b->items[--b->count];
+                break;
+            }
+        }
+    }
+    s->inserted = 0;
+}
+
+// Re-inserts a wall under its new bounds; also used for the first insert
+static inline void grid_update(Grid *grid, int index, Vec3 lo, Vec3 hi)
+{
+    grid_reserve(grid, index + 1);
+    grid_remove(grid, index);
+
+    GridSpan *s = &grid->spans[index];
+    s->x0 = grid_cell(lo.x);
+    s->z0 = grid_cell(lo.z);
+    s->x1 = grid_cell(hi.x);
+    s->z1 = grid_cell(hi.z);
+    s->inserted = 1;
+
+    for (int cz = s->z0; cz <= s->z1; cz++)
+    {
+        for (int cx = s->x0; cx <= s->x1; cx++)
+        {
+            GridBucket *b = grid_bucket(grid, cx, cz);
+            if (b->count >= b->capacity)
+            {
+                b->capacity = b->capacity ? b->capacity * 2 : 8;
+                b->items = (int *)realloc(b->items, sizeof(int) * b->capacity);
+            }
+            b->items[b->count++] = index;
+        }
+    }
+
+    grid->min_y = fminf(grid->min_y, lo.y);
+    grid->max_y = fmaxf(grid->max_y, hi.y);
+}
+
+// Starts a query; grid_visit then reports each wall once per query
+static inline void grid_begin_query(Grid *grid)
+{
+    if (++grid->query == 0)
+    {
+        for (int i = 0; i < grid->capacity; i++) grid->stamp[i] = 0;
+        grid->query = 1;
+    }
+}
+
+static inline int grid_visit(Grid *grid, int index)
+{
+    if (grid->stamp[index] == grid->query) return 0;
+    grid->stamp[index] = grid->query;
+    return 1;
+}
+
+#endif // GRID_H
@@ -0,0 +1,457 @@
+#ifndef GROUND_H
+#define GROUND_H
+
+#include "game.h"
+#include "util.h"
+#include "lights.h"
+#include "texture.h"
+#include "span.h"
+
+// Checkerboard floor at y = floor_y, drawn by intersecting each pixel's view
+// ray with the plane instead of submitting thousands of tile quads
+typedef struct
+{
+    int active;
+    View view;
+    Light light;
+    float floor_y;
+    float tile_size;
+    float origin_x;
+    float origin_z;
+    int tiles_x;
+    int tiles_z;
+    uint32_t c1;
+    uint32_t c2;
+    float depth_scale;
+    float depth_offset;
+
+    // Light's shadow map when it is valid, else NULL
+    const ShadowMap *shadow;
+
+    // Binned point lights, NULL without any
+    const LightBins *lights;
+
+    // Repeated once per tile and scaled by its color, NULL for none
+    const Texture *texture;
+}
+Ground;
+
+// Lit and fogged once per tile at its center, like the old per-tile quads.
+// Returns 0 for tiles past the fog end, which are left to the background.
+// The shadow map is looked up per pixel instead, so with one present the
+// tile's color in full shadow goes to *shadowed. With a texture, fog has to
+// go over the texel: the colors are only scaled by the share fog leaves and
+// the fog's own share goes to *fog_part, to be added per pixel.
+static inline uint32_t ground_tile_color(const Ground *g, int ix, int iz, uint32_t *shadowed, uint32_t *fog_part)
+{
+    Vec3 center = {
+        g->origin_x + (ix + 0.5f) * g->tile_size,
+        g->floor_y,
+        g->origin_z + (iz + 0.5f) * g->tile_size
+    };
+    float dist = vec3_distance(center, g->view.eye);
+    if (dist > g_fog_end) return 0;
+
+    Vec3 normal = { 0.0f, -1.0f, 0.0f };
+    uint32_t c = ((ix + iz) & 1) ? g->c1 : g->c2;
+    Light light = g->light;
+    light.shadow = NULL;
+    int keep = (int)(fog_keep(dist) * 256.0f);
+    if (g->texture) *fog_part = texture_shade(g_fog_color, 256 - keep) & 0xFFFFFF;
+    if (g->shadow)
+    {
+        Light dark = light;
+        dark.intensity = 0.0f;
+        uint32_t lit = apply_lighting(c, normal, center, dark);
+        *shadowed = g->texture ? texture_shade(lit, keep) : apply_fog(lit, dist) | 0xFF000000;
+    }
+    uint32_t lit = apply_lighting(c, normal, center, light);
+    return g->texture ? texture_shade(lit, keep) : apply_fog(lit, dist) | 0xFF000000;
+}
+
+// a with k/4 of the way to b, per channel
+static inline uint32_t ground_blend(uint32_t a, uint32_t b, int k)
+{
+    uint32_t rb = ((a & 0xFF00FFu) * (4 - k) + (b & 0xFF00FFu) * k) >> 2;
+    uint32_t g = ((a & 0xFF00u) * (4 - k) + (b & 0xFF00u) * k) >> 2;
+    return 0xFF000000u | (rb & 0xFF00FFu) | (g & 0xFF00u);
+}
+
+// Clamps a run length to the pixels left before the next cell boundary
+static inline int ground_run(int run, float pixels)
+{
+    if (pixels < (float)run) run = (int)pixels + 1;
+    return run;
+}
+
+// Texel at the top left of the 2x2 footprint around c, -1 to size - 1
+static inline int ground_shadow_texel(const ShadowMap *sm, float t)
+{
+    // Clamped to -1 and up, so truncating from 0 and up floors
+    return (int)clamp(0.0f, t + 0.5f, sm->size + 1.0f) - 1;
+}
+
+// Lit taps, 0 to 4, of the 2x2 percentage-closer filter at c
+static inline int ground_shadow_taps(const ShadowMap *sm, ShadowCoord c)
+{
+    if (c.face < 0) return 4;
+
+    int tx = ground_shadow_texel(sm, c.u);
+    int ty = ground_shadow_texel(sm, c.v);
+    int last = sm->size - 1;
+    if (tx < 0 || ty < 0 || tx >= last || ty >= last)
+    {
+        return shadow_lit(sm, c.face, tx, ty, c.depth) + shadow_lit(sm, c.face, tx + 1, ty, c.depth)
+            + shadow_lit(sm, c.face, tx, ty + 1, c.depth) + shadow_lit(sm, c.face, tx + 1, ty + 1, c.depth);
+    }
+
+    // Taps in a block lying wholly in front or behind need no reads
+    const float *b = &sm->coarse[2 * ((c.face * sm->blocks + ty / SHADOW_BLOCK) * sm->blocks + tx / SHADOW_BLOCK)];
+    if (c.depth <= b[0]) return 4;
+    if (c.depth > b[1]) return 0;
+
+    const float *t = sm->target.shadow_depth + (c.face * sm->size + ty) * sm->size + tx;
+    return (c.depth <= t[0]) + (c.depth <= t[1]) + (c.depth <= t[sm->size]) + (c.depth <= t[sm->size + 1]);
+}
+
+// Lit taps shared by every point between a and b, both on one face, or -1.
+// Blocks are convex and depth is interpolated, so when both ends fall in
+// one block on the same side of all its depths, everything between does.
+static inline int ground_shadow_span(const ShadowMap *sm, ShadowCoord a, ShadowCoord b)
+{
+    int ax = ground_shadow_texel(sm, a.u), ay = ground_shadow_texel(sm, a.v);
+    int bx = ground_shadow_texel(sm, b.u), by = ground_shadow_texel(sm, b.v);
+    int last = sm->size - 1;
+    if (ax < 0 || ay < 0 || ax >= last || ay >= last) return -1;
+    if (ax / SHADOW_BLOCK != bx / SHADOW_BLOCK || ay / SHADOW_BLOCK != by / SHADOW_BLOCK) return -1;
+    if (bx < 0 || by < 0 || bx >= last || by >= last) return -1;
+
+    const float *block = &sm->coarse[2 * ((a.face * sm->blocks + ay / SHADOW_BLOCK) * sm->blocks + ax / SHADOW_BLOCK)];
+    if (a.depth <= block[0] && b.depth <= block[0]) return 4;
+    if (a.depth > block[1] && b.depth > block[1]) return 0;
+    return -1;
+}
+
+// Point light on a run of ground pixels, packed per pixel as channels to
+// add to its color. Runs are split to at most GROUND_MAX_RUN pixels so the
+// gains, like a run's shades and texels, fit on the stack; the light is
+// evaluated every GROUND_LIGHT_STEP pixels and interpolated between, as its
+// falloff is smooth.
+#define GROUND_MAX_RUN 64
+#define GROUND_LIGHT_STEP 16
+
+// c with each channel of gain added, saturating
+static inline uint32_t ground_add_light(uint32_t c, uint32_t gain)
+{
+    uint32_t sum = (c & 0x7F7F7F7Fu) + (gain & 0x7F7F7F7Fu);
+    uint32_t top = (c ^ gain) & 0x80808080u;
+    uint32_t carry = ((c & gain) | ((c | gain) & sum)) & 0x80808080u;
+    return (sum ^ top) | ((carry >> 7) * 0xFF);
+}
+
+// Gains of the listed lights on base color c over run pixels from world
+// position p, stepping by dp; keep is the share of c surviving the tile's
+// fog. Returns 0, leaving gains unset, when no light reaches the run.
+static inline int ground_light_gains(Vec3 p, Vec3 dp, int run, uint32_t c, float keep, LightList lights, uint32_t *gains)
+{
+    Vec3 normal = { 0.0f, -1.0f, 0.0f };
+    float base[3] = {
+        ((c >> 16) & 0xFF) * keep * 65536.0f,
+        ((c >> 8) & 0xFF) * keep * 65536.0f,
+        (c & 0xFF) * keep * 65536.0f
+    };
+    float next[3];
+    int reached = lights_sum(normal, p, lights, next);
+    for (int i = 0; i < run; i += GROUND_LIGHT_STEP)
+    {
+        int n = run - i < GROUND_LIGHT_STEP ? run - i : GROUND_LIGHT_STEP;
+
+        // Channel gains in 16.16 fixed point along the chunk
+        int add[3], step[3];
+        for (int k = 0; k < 3; k++) add[k] = (int)fminf(base[k] * next[k], 255.0f * 65536.0f);
+        reached |= lights_sum(normal, vec3_add(p, vec3_scale(dp, (float)(i + n))), lights, next);
+        for (int k = 0; k < 3; k++) step[k] = ((int)fminf(base[k] * next[k], 255.0f * 65536.0f) - add[k]) / n;
+
+        for (int j = 0; j < n; j++)
+        {
+            gains[i + j] = ((uint32_t)(add[0] >> 16) << 16) | ((uint32_t)(add[1] >> 16) << 8) | (uint32_t)(add[2] >> 16);
+            add[0] += step[0];
+            add[1] += step[1];
+            add[2] += step[2];
+        }
+    }
+    return reached;
+}
+
+// One mip level of the ground texture, chosen per row
+typedef struct
+{
+    const uint32_t *texels;
+    int w_log2;
+    int w_mask;
+    int h_mask;
+}
+GroundMip;
+
+static inline GroundMip ground_mip(const Texture *t, float rho)
+{
+    int lod = texture_lod(t, rho);
+    int w_log2 = t->w_log2 - lod, h_log2 = t->h_log2 - lod;
+    GroundMip mip = { t->texels + t->offset[lod], w_log2, (1 << w_log2) - 1, (1 << h_log2) - 1 };
+    return mip;
+}
+
+// Texels of a run from (tu, tv), stepping by (du, dv), all 16.16 texels
+static inline void ground_texels(GroundMip mip, int32_t tu, int32_t tv, int32_t du, int32_t dv, int run, uint32_t *out)
+{
+    for (int i = 0; i < run; i++)
+    {
+        out[i] = mip.texels[texture_texel_index(mip.w_log2, (tu >> 16) & mip.w_mask, (tv >> 16) & mip.h_mask)];
+        tu += du;
+        tv += dv;
+    }
+}
+
+// Pixel i of a run from its shade c: the point lights' gain added, then,
+// with a texture, the texel scaled by that and the fog share added
+static inline uint32_t ground_pixel(uint32_t c, const uint32_t *gains, const uint32_t *texels, uint32_t fog_part, int i)
+{
+    if (gains) c = ground_add_light(c, gains[i]);
+    if (texels) c = ground_add_light(texture_modulate(texels[i], c), fog_part);
+    return c;
+}
+
+// Shades of a run of ground pixels with 2x2 percentage-closer shadows, into
+// out; sp and sd are the first pixel's position relative to the map origin
+// and its step per pixel. The map position is projected every
+// GROUND_SHADOW_STEP pixels and interpolated between, which is exact on the
+// orthographic map and on the face looking down, where depth along a row is
+// constant.
+#define GROUND_SHADOW_STEP 8
+
+static inline void ground_shadowed_run(const Ground *g, int run, Vec3 sp, Vec3 sd, uint32_t lit, uint32_t shadowed, uint32_t *out)
+{
+    const ShadowMap *sm = g->shadow;
+    uint32_t shades[5];
+    for (int k = 0; k <= 4; k++) shades[k] = ground_blend(shadowed, lit, k);
+
+    ShadowCoord next = shadow_coord(sm, sp, SHADOW_BIAS);
+    for (int i = 0; i < run; i += GROUND_SHADOW_STEP)
+    {
+        int n = run - i < GROUND_SHADOW_STEP ? run - i : GROUND_SHADOW_STEP;
+        ShadowCoord c = next;
+        next = shadow_coord(sm, vec3_add(sp, vec3_scale(sd, (float)(i + n))), SHADOW_BIAS);
+
+        // Across a face edge every pixel is projected on its own
+        int linear = c.face >= 0 && c.face == next.face;
+        float inv = 1.0f / n;
+        float du = (next.u - c.u) * inv;
+        float dv = (next.v - c.v) * inv;
+        float dd = (next.depth - c.depth) * inv;
+        int k = linear ? ground_shadow_span(sm, c, next) : -1;
+        if (k >= 0)
+        {
+            for (int j = 0; j < n; j++) out[i + j] = shades[k];
+            continue;
+        }
+        for (int j = 0; j < n; j++)
+        {
+            ShadowCoord at = linear
+                ? (ShadowCoord){ c.face, c.u + du * j, c.v + dv * j, c.depth + dd * j }
+                : shadow_coord(sm, vec3_add(sp, vec3_scale(sd, (float)(i + j))), SHADOW_BIAS);
+            out[i + j] = shades[ground_shadow_taps(sm, at)];
+        }
+    }
+}
+
+#ifdef SPAN_X86
+
+// ground_write_run four pixels at a time: ground_add_light is a saturating
+// byte add, and every product of texture_modulate fits 16 bits. Returns how
+// many pixels it handled, a multiple of four.
+__attribute__((target("sse2")))
+static inline int ground_write_sse2(uint32_t *color, float *depth, int run, float z, uint32_t lit, const uint32_t *shades, const uint32_t *gains, const uint32_t *texels, uint32_t fog_part, int *written)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i one = _mm_set1_epi16(1);
+    __m128i fog = _mm_set1_epi32((int)fog_part);
+    __m128 zv = _mm_set1_ps(z);
+    int i = 0;
+    for (; i + 4 <= run; i += 4)
+    {
+        __m128i c = shades ? _mm_loadu_si128((const __m128i *)(shades + i)) : _mm_set1_epi32((int)lit);
+        if (gains) c = _mm_adds_epu8(c, _mm_loadu_si128((const __m128i *)(gains + i)));
+        if (texels)
+        {
+            __m128i t = _mm_loadu_si128((const __m128i *)(texels + i));
+            __m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(t, zero), _mm_add_epi16(_mm_unpacklo_epi8(c, zero), one)), 8);
+            __m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(t, zero), _mm_add_epi16(_mm_unpackhi_epi8(c, zero), one)), 8);
+            c = _mm_adds_epu8(_mm_packus_epi16(lo, hi), fog);
+        }
+
+        __m128 dv = _mm_loadu_ps(depth + i);
+        __m128 mf = _mm_cmplt_ps(zv, dv);
+        __m128i mask = _mm_castps_si128(mf);
+        *written += __builtin_popcount(_mm_movemask_ps(mf));
+        _mm_storeu_ps(depth + i, _mm_or_ps(_mm_and_ps(mf, zv), _mm_andnot_ps(mf, dv)));
+        __m128i old = _mm_loadu_si128((const __m128i *)(color + i));
+        _mm_storeu_si128((__m128i *)(color + i), _mm_or_si128(_mm_and_si128(mask, c), _mm_andnot_si128(mask, old)));
+    }
+    return i;
+}
+
+#endif // SPAN_X86
+
+// Writes a run of ground pixels at depth z from (x, y): shades[i], or lit
+// for every pixel when shades is NULL, through ground_pixel. Returns the
+// number of pixels written.
+static inline int ground_write_run(buffer *buf, int x, int y, int run, float z, uint32_t lit, const uint32_t *shades, const uint32_t *gains, const uint32_t *texels, uint32_t fog_part)
+{
+    uint32_t *color = (uint32_t *)buf->mem + y * buf->w + x;
+    float *depth = buf->depth_buffer + y * buf->w + x;
+    int written = 0;
+    int i = 0;
+#ifdef SPAN_X86
+    i = ground_write_sse2(color, depth, run, z, lit, shades, gains, texels, fog_part, &written);
+#endif
+    for (; i < run; i++)
+    {
+        if (!(z < depth[i])) continue;
+        depth[i] = z;
+        color[i] = ground_pixel(shades ? shades[i] : lit, gains, texels, fog_part, i);
+        written++;
+    }
+    return written;
+}
+
+// Rasterizes the ground into the pixel rect [x0, x1] x [y0, y1]. Along a
+// scanline the ray/plane distance is constant (the camera never rolls), so
+// the tile coordinates are linear in screen x and depth is constant per row.
+// Returns the number of pixels written.
+static inline int ground_draw(const Ground *g, buffer *buf, int x0, int y0, int x1, int y1)
+{
+    const View *v = &g->view;
+    const float (*m)[4] = v->m;
+    float inv_f = 1.0f / v->focal_length;
+    float inv_tile = 1.0f / g->tile_size;
+    float height = g->floor_y - v->eye.y;
+    int written = 0;
+
+    for (int y = y0; y <= y1; y++)
+    {
+        float dy = (y + 0.5f - v->center_y) * inv_f;
+
+        // World-space y of the ray (right.y is always 0)
+        float dir_y = m[1][1] * dy + m[2][1];
+        if (dir_y * height <= 0.0f) continue;
+        float t = height / dir_y;
+        if (t >= g_fog_end + g->tile_size || t >= Z_FAR) continue;
+
+        // Nearer than Z_NEAR when the eye is down at the floor
+        float z = fmaxf(view_depth(t), 0.0f) * g->depth_scale + g->depth_offset;
+        float dx = (x0 + 0.5f - v->center_x) * inv_f;
+
+        // Tile-space coordinates at x0 and their step per pixel
+        float u = (v->eye.x + t * (m[0][0] * dx + m[1][0] * dy + m[2][0]) - g->origin_x) * inv_tile;
+        float w = (v->eye.z + t * (m[0][2] * dx + m[1][2] * dy + m[2][2]) - g->origin_z) * inv_tile;
+        float du = t * m[0][0] * inv_f * inv_tile;
+        float dw = t * m[0][2] * inv_f * inv_tile;
+
+        // The world position is linear along the row too, stepping by
+        // t * right * inv_f; the shadow map takes it relative to its origin
+        Vec3 wp = {
+            v->eye.x + t * (m[0][0] * dx + m[1][0] * dy + m[2][0]),
+            g->floor_y,
+            v->eye.z + t * (m[0][2] * dx + m[1][2] * dy + m[2][2])
+        };
+        Vec3 sd = { t * m[0][0] * inv_f, 0.0f, t * m[0][2] * inv_f };
+        Vec3 sp = g->shadow ? vec3_sub(wp, g->shadow->origin) : wp;
+
+        // Mip level from the larger of the tile-space steps to the next
+        // pixel and to the next row; texel steps in 16.16 of that level
+        GroundMip mip = {0};
+        float tex_du = 0.0f, tex_dw = 0.0f, tex_w = 0.0f, tex_h = 0.0f;
+        if (g->texture)
+        {
+            float down = 1e9f;
+            float dy1 = dy + inv_f;
+            float dir_y1 = m[1][1] * dy1 + m[2][1];
+            if (dir_y1 * height > 0.0f)
+            {
+                float t1 = height / dir_y1;
+                float u1 = (v->eye.x + t1 * (m[0][0] * dx + m[1][0] * dy1 + m[2][0]) - g->origin_x) * inv_tile;
+                float w1 = (v->eye.z + t1 * (m[0][2] * dx + m[1][2] * dy1 + m[2][2]) - g->origin_z) * inv_tile;
+                down = (u1 - u) * (u1 - u) + (w1 - w) * (w1 - w);
+            }
+            float size = (float)(1 << (g->texture->w_log2 > g->texture->h_log2 ? g->texture->w_log2 : g->texture->h_log2));
+            mip = ground_mip(g->texture, sqrtf(fmaxf(du * du + dw * dw, down)) * size);
+            tex_w = (float)(mip.w_mask + 1) * 65536.0f;
+            tex_h = (float)(mip.h_mask + 1) * 65536.0f;
+            tex_du = fmaxf(fminf(du * tex_w, 1e9f), -1e9f);
+            tex_dw = fmaxf(fminf(dw * tex_h, 1e9f), -1e9f);
+        }
+
+        // Walk the row in runs of pixels that stay inside one checker cell
+        int x = x0;
+        while (x <= x1)
+        {
+            float uc = u + du * (x - x0);
+            float wc = w + dw * (x - x0);
+            float fu = floorf(uc);
+            float fw = floorf(wc);
+
+            int run = x1 - x + 1;
+            if (du > 0.0f) run = ground_run(run, (fu + 1.0f - uc) / du);
+            if (du < 0.0f) run = ground_run(run, (uc - fu) / -du);
+            if (dw > 0.0f) run = ground_run(run, (fw + 1.0f - wc) / dw);
+            if (dw < 0.0f) run = ground_run(run, (wc - fw) / -dw);
+
+            int ix = (int)fu;
+            int iz = (int)fw;
+            uint32_t lit = 0;
+            uint32_t shadowed = 0;
+            uint32_t fog_part = 0;
+            if (ix >= 0 && iz >= 0 && ix < g->tiles_x && iz < g->tiles_z)
+                lit = ground_tile_color(g, ix, iz, &shadowed, &fog_part);
+
+            uint32_t gains[GROUND_MAX_RUN];
+            uint32_t texels[GROUND_MAX_RUN];
+            const uint32_t *run_gains = NULL;
+            const uint32_t *run_texels = NULL;
+            LightList lights = { NULL, NULL, 0 };
+            if (lit != 0 && g->lights && g_light_active) lights = lights_floor_tile(g->lights, ix, iz);
+            if (run > GROUND_MAX_RUN) run = GROUND_MAX_RUN;
+            if (lit != 0 && g->texture)
+            {
+                // The run stays in one tile, so its fraction of the tile is
+                // all the texture needs
+                int32_t tu = (int32_t)((uc - fu) * tex_w), tv = (int32_t)((wc - fw) * tex_h);
+                ground_texels(mip, tu, tv, (int32_t)tex_du, (int32_t)tex_dw, run, texels);
+                run_texels = texels;
+            }
+            if (lights.count > 0)
+            {
+                uint32_t c = ((ix + iz) & 1) ? g->c1 : g->c2;
+                Vec3 center = { g->origin_x + (ix + 0.5f) * g->tile_size, g->floor_y, g->origin_z + (iz + 0.5f) * g->tile_size };
+                Vec3 at = vec3_add(wp, vec3_scale(sd, (float)(x - x0)));
+                if (ground_light_gains(at, sd, run, c, fog_keep(vec3_distance(center, v->eye)), lights, gains))
+                    run_gains = gains;
+            }
+
+            uint32_t shades[GROUND_MAX_RUN];
+            const uint32_t *run_shades = NULL;
+            if (lit != 0 && g->shadow)
+            {
+                Vec3 at = vec3_add(sp, vec3_scale(sd, (float)(x - x0)));
+                ground_shadowed_run(g, run, at, sd, lit, shadowed, shades);
+                run_shades = shades;
+            }
+            if (lit != 0)
+                written += ground_write_run(buf, x, y, run, z, lit, run_shades, run_gains, run_texels, fog_part);
+            x += run;
+        }
+    }
+    return written;
+}
+
+#endif // GROUND_H
@@ -0,0 +1,285 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include "game.h"
+#include "scale.h"
+
+// Renders frames straight into a buffer and writes them to disk, no X
+// connection involved:
+//   ./bin/game --headless [--frames N] [--size WxH] [--level file | --stress N]
+//              [--camera x,y,z,ax,ay | --path file] [--out prefix] [--raw]
+// --bench renders the same way without writing frames and prints one JSON
+// line of timings and counters after --warmup untimed frames. --trace file
+// records a Chrome trace, windowed or not, and --hud draws the profiler HUD
+// into headless frames. The window takes --no-shm, --buffers 2|3 and
+// --fps N (0 uncapped) or --vsync to pace frames on presentation. Both take
+// --shade flat|vertex|pixel, --no-fog, --no-light, --no-depth-test,
+// --shadow N for the shadow map resolution (0 turns shadows off) and
+// --no-bake to light walls every frame instead of from the lightmap.
+// --scale F draws the scene at F times the frame size and upscales it with
+// --upscale nearest|bilinear|edge; --scale auto picks the scale to keep the
+// render cost at --target-ms (the --fps interval by default). The window
+// scales automatically by default, headless frames only when asked to.
+typedef struct
+{
+    int enabled;
+    int bench;
+    int warmup;
+    int stress;
+    int frames;
+    int width;
+    int height;
+    int raw;
+    int hud;
+    int no_shm;
+    int buffers;
+    int fps;
+    int vsync;
+    ShadeMode shade;
+    int no_fog;
+    int no_light;
+    int no_depth_test;
+    int no_bake;
+    int shadow;
+    float scale;
+    float target_ms;
+    UpscaleFilter upscale;
+    const char *trace;
+    const char *level;
+    const char *path;
+    const char *out;
+    Camera camera;
+}
+HeadlessOptions;
+
+// Keyframes sampled evenly over the frame count, one "x y z ax ay" per line
+typedef struct
+{
+    Camera *keys;
+    int count;
+}
+CameraPath;
+
+static inline Camera headless_default_camera(void)
+{
+    Camera cam = {};
+    cam.distance = 300.0f;
+    cam.angle_x = 210.0f;
+    cam.angle_y = 0.0f;
+    cam.pos_x = -50.0f;
+    cam.pos_y = 0.0f;
+    cam.pos_z = 400.0f;
+    return cam;
+}
+
+// Returns 0 on a malformed command line
+static inline int headless_parse(int argc, char **argv, HeadlessOptions *opt)
+{
+    *opt = (HeadlessOptions){0};
+    opt->frames = 1;
+    opt->warmup = 10;
+    opt->buffers = 3;
+    opt->fps = FPS;
+    opt->shade = SHADE_FLAT;
+    opt->shadow = SHADOW_DEFAULT_SIZE;
+    opt->upscale = UPSCALE_BILINEAR;
+    opt->width = 1200;
+    opt->height = 800;
+    opt->level = "level.txt";
+    opt->out = "frame";
+    opt->camera = headless_default_camera();
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+        Camera *c = &opt->camera;
+
+        if (strcmp(arg, "--headless") == 0) { opt->enabled = 1; continue; }
+        if (strcmp(arg, "--raw") == 0) { opt->raw = 1; continue; }
+        if (strcmp(arg, "--bench") == 0) { opt->enabled = opt->bench = 1; continue; }
+        if (strcmp(arg, "--hud") == 0) { opt->hud = 1; continue; }
+        if (strcmp(arg, "--no-shm") == 0) { opt->no_shm = 1; continue; }
+        if (strcmp(arg, "--vsync") == 0) { opt->vsync = 1; continue; }
+        if (strcmp(arg, "--no-fog") == 0) { opt->no_fog = 1; continue; }
+        if (strcmp(arg, "--no-light") == 0) { opt->no_light = 1; continue; }
+        if (strcmp(arg, "--no-depth-test") == 0) { opt->no_depth_test = 1; continue; }
+        if (strcmp(arg, "--no-bake") == 0) { opt->no_bake = 1; continue; }
+
+        if (strncmp(arg, "--", 2) == 0 && !val)
+        {
+            printf("[ERROR] Missing value for %s\n", arg);
+            return 0;
+        }
+        if (strcmp(arg, "--frames") == 0) { opt->frames = atoi(val); i++; }
+        else if (strcmp(arg, "--warmup") == 0) { opt->warmup = atoi(val); i++; }
+        else if (strcmp(arg, "--stress") == 0) { opt->stress = atoi(val); i++; }
+        else if (strcmp(arg, "--level") == 0)  { opt->level = val; i++; }
+        else if (strcmp(arg, "--path") == 0)   { opt->path = val; i++; }
+        else if (strcmp(arg, "--out") == 0)    { opt->out = val; i++; }
+        else if (strcmp(arg, "--trace") == 0)  { opt->trace = val; i++; }
+        else if (strcmp(arg, "--buffers") == 0) { opt->buffers = atoi(val); i++; }
+        else if (strcmp(arg, "--fps") == 0)    { opt->fps = atoi(val); i++; }
+        else if (strcmp(arg, "--shadow") == 0) { opt->shadow = atoi(val); i++; }
+        else if (strcmp(arg, "--target-ms") == 0) { opt->target_ms = (float)atof(val); i++; }
+        else if (strcmp(arg, "--scale") == 0)
+        {
+            opt->scale = strcmp(val, "auto") == 0 ? SCALE_AUTO : (float)atof(val);
+            if (opt->scale != SCALE_AUTO && (opt->scale < SCALE_MIN || opt->scale > 1.0f)) return 0;
+            i++;
+        }
+        else if (strcmp(arg, "--upscale") == 0)
+        {
+            int f = 0;
+            while (f < UPSCALE_FILTER_COUNT && strcmp(val, g_upscale_names[f]) != 0) f++;
+            if (f == UPSCALE_FILTER_COUNT) return 0;
+            opt->upscale = (UpscaleFilter)f;
+            i++;
+        }
+        else if (strcmp(arg, "--shade") == 0)
+        {
+            if (strcmp(val, "flat") == 0) opt->shade = SHADE_FLAT;
+            else if (strcmp(val, "vertex") == 0) opt->shade = SHADE_VERTEX;
+            else if (strcmp(val, "pixel") == 0) opt->shade = SHADE_PIXEL;
+            else return 0;
+            i++;
+        }
+        else if (strcmp(arg, "--size") == 0)
+        {
+            if (sscanf(val, "%dx%d", &opt->width, &opt->height) != 2) return 0;
+            i++;
+        }
+        else if (strcmp(arg, "--camera") == 0)
+        {
+            if (sscanf(val, "%f,%f,%f,%f,%f",
+                &c->pos_x, &c->pos_y, &c->pos_z, &c->angle_x, &c->angle_y) != 5) return 0;
+            i++;
+        }
+        else
+        {
+            printf("[ERROR] Unknown argument %s\n", arg);
+            return 0;
+        }
+    }
+
+    if (opt->frames < 1 || opt->warmup < 0 || opt->stress < 0 || opt->fps < 0 || opt->target_ms < 0.0f) return 0;
+    if (opt->width < 1 || opt->height < 1) return 0;
+    if (opt->buffers < 2 || opt->buffers > 3) return 0;
+
+    // Automatic scaling aims at the frame interval unless told otherwise
+    if (opt->target_ms == 0.0f) opt->target_ms = 1000.0f / (opt->fps > 0 ? opt->fps : FPS);
+    return 1;
+}
+
+static inline int camera_path_load(const char *filename, CameraPath *path)
+{
+    *path = (CameraPath){0};
+    FILE *f = fopen(filename, "r");
+    if (!f)
+    {
+        printf("[ERROR] Couldn't open camera path %s\n", filename);
+        return 0;
+    }
+
+    int capacity = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        if (line[0] == '\n' || line[0] == '#' || line[0] == '\0')
+            continue;
+
+        Camera cam = headless_default_camera();
+        if (sscanf(line, "%f %f %f %f %f",
+            &cam.pos_x, &cam.pos_y, &cam.pos_z, &cam.angle_x, &cam.angle_y) != 5)
+            continue;
+
+        if (path->count >= capacity)
+        {
+            capacity = capacity ? capacity * 2 : 16;
+            path->keys = (Camera *)realloc(path->keys, sizeof(Camera) * capacity);
+        }
+        path->keys[path->count++] = cam;
+    }
+    fclose(f);
+
+    printf("[LOG] Loaded %d camera keys from %s\n", path->count, filename);
+    return path->count > 0;
+}
+
+static inline void camera_path_free(CameraPath *path)
+{
+    free(path->keys);
+    *path = (CameraPath){0};
+}
+
+// Linear interpolation between keys, frame 0 on the first key and the last
+// frame on the last one
+static inline Camera camera_path_sample(const CameraPath *path, int frame, int frames)
+{
+    if (path->count == 1 || frames <= 1) return path->keys[0];
+
+    float t = (float)frame / (float)(frames - 1) * (float)(path->count - 1);
+    int i = (int)t;
+    if (i >= path->count - 1) return path->keys[path->count - 1];
+    float f = t - (float)i;
+
+    Camera a = path->keys[i];
+    Camera b = path->keys[i + 1];
+    a.pos_x += (b.pos_x - a.pos_x) * f;
+    a.pos_y += (b.pos_y - a.pos_y) * f;
+    a.pos_z += (b.pos_z - a.pos_z) * f;
+    a.angle_x += (b.angle_x - a.angle_x) * f;
+    a.angle_y += (b.angle_y - a.angle_y) * f;
+    return a;
+}
+
+static int headless_cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted frame times, in milliseconds
+static inline double headless_percentile(const uint64_t *sorted, int count, double p)
+{
+    int rank = (int)ceil(p * count) - 1;
+    if (rank < 0) rank = 0;
+    if (rank > count - 1) rank = count - 1;
+    return (double)sorted[rank] / 1e6;
+}
+
+// Binary PPM; pixels are stored as 0xAARRGGBB
+static inline int write_ppm(const buffer *buf, const char *filename)
+{
+    FILE *f = fopen(filename, "wb");
+    if (!f) return 0;
+
+    fprintf(f, "P6\n%d %d\n255\n", buf->w, buf->h);
+    uint8_t *row = (uint8_t *)malloc(buf->w * 3);
+    for (int y = 0; y < (int)buf->h; y++)
+    {
+        const uint32_t *src = (const uint32_t *)(buf->mem + y * buf->pitch);
+        for (int x = 0; x < (int)buf->w; x++)
+        {
+            row[x * 3 + 0] = (src[x] >> 16) & 0xFF;
+            row[x * 3 + 1] = (src[x] >> 8) & 0xFF;
+            row[x * 3 + 2] = src[x] & 0xFF;
+        }
+        fwrite(row, 1, buf->w * 3, f);
+    }
+    free(row);
+    fclose(f);
+    return 1;
+}
+
+// The buffer as-is, w * h 32-bit pixels
+static inline int write_raw(const buffer *buf, const char *filename)
+{
+    FILE *f = fopen(filename, "wb");
+    if (!f) return 0;
+    fwrite(buf->mem, 1, buf->size, f);
+    fclose(f);
+    return 1;
+}
+
+#endif // HEADLESS_H
@@ -3,6 +3,8 @@
 
 #include "util.h"
 #include "triangle.h"
+#include "grid.h"
+#include "texture.h"
 #include "game.h"
 
 static inline Level* level_create(int initial_capacity)
@@ -11,9 +13,33 @@ static inline Level* level_create(int initial_capacity)
     level->wall_capacity = initial_capacity;
     level->wall_count = 0;
     level->walls = (Wall*)malloc(sizeof(Wall) * initial_capacity);
+    level->mesh = (Mesh){0};
+    level->dirty = (uint8_t*)calloc(initial_capacity, sizeof(uint8_t));
+    level->dirty_count = 0;
+    level->revision = 0;
+    grid_init(&level->grid);
+    level->visible = (int*)malloc(sizeof(int) * initial_capacity);
+    level->lightmap = (Lightmap){ .enabled = 1 };
+    level->lights = NULL;
+    level->light_count = 0;
+    level->light_capacity = 0;
+    level->light_bins = (LightBins){0};
+    level->textures = NULL;
+    level->texture_count = 0;
+    level->texture_capacity = 0;
+    level->ground_texture = 0;
     return level;
 }
 
+// Call after changing a wall so its baked quad is rebuilt before the next draw
+static inline void level_mark_dirty(Level* level, int index)
+{
+    if (index < 0 || index >= level->wall_count) return;
+    level->revision++;
+    if (!level->dirty[index]) level->dirty_count++;
+    level->dirty[index] = 1;
+}
+
 static inline void level_add_wall(Level* level, Wall wall)
 {
     if (level->wall_count >= level->wall_capacity)
@@ -21,20 +47,300 @@ static inline void level_add_wall(Level* level, Wall wall)
         level->wall_capacity *= 2;
         level->walls =
             (Wall*)realloc(level->walls, sizeof(Wall) * level->wall_capacity);
+        level->dirty =
+            (uint8_t*)realloc(level->dirty, sizeof(uint8_t) * level->wall_capacity);
+        level->visible =
+            (int*)realloc(level->visible, sizeof(int) * level->wall_capacity);
     }
+    level->dirty[level->wall_count] = 0;
     level->walls[level->wall_count++] = wall;
+    level_mark_dirty(level, level->wall_count - 1);
+}
+
+static inline void level_add_light(Level* level, PointLight light)
+{
+    if (level->light_count >= level->light_capacity)
+    {
+        level->light_capacity = level->light_capacity ? level->light_capacity * 2 : 8;
+        level->lights =
+            (PointLight*)realloc(level->lights, sizeof(PointLight) * level->light_capacity);
+    }
+    level->lights[level->light_count++] = light;
+}
+
+// 1 + the index of the texture called name, made on first use: a built-in
+// one when texture_builtin knows the name, else the PPM file name relative
+// to dir. Returns 0, untextured, when neither works.
+static inline int level_texture(Level* level, const char* name, const char* dir)
+{
+    for (int i = 0; i < level->texture_count; i++)
+        if (strcmp(level->textures[i].name, name) == 0) return i + 1;
+
+    int w = TEXTURE_BUILTIN_SIZE, h = TEXTURE_BUILTIN_SIZE;
+    uint32_t* pixels = texture_builtin(name);
+    if (!pixels)
+    {
+        char path[512];
+        snprintf(path, sizeof(path), "%s%s", dir, name);
+        pixels = texture_load_ppm(path, &w, &h);
+    }
+    Texture texture;
+    int ok = pixels && texture_create(&texture, name, w, h, pixels);
+    free(pixels);
+    if (!ok)
+    {
+        printf("[ERROR] Couldn't load texture %s\n", name);
+        return 0;
+    }
+
+    if (level->texture_count >= level->texture_capacity)
+    {
+        level->texture_capacity = level->texture_capacity ? level->texture_capacity * 2 : 4;
+        level->textures =
+            (Texture*)realloc(level->textures, sizeof(Texture) * level->texture_capacity);
+    }
+    level->textures[level->texture_count++] = texture;
+    printf("[LOG] Texture %s: %dx%d, %d mip levels\n", name, 1 << texture.w_log2, 1 << texture.h_log2, texture.levels);
+    return level->texture_count;
+}
+
+// Name of a texture index as walls hold it, NULL for none
+static inline const char* level_texture_name(const Level* level, int texture)
+{
+    return (texture > 0 && texture <= level->texture_count) ? level->textures[texture - 1].name : NULL;
 }
 
 static inline void level_free(Level* level)
 {
+    for (int i = 0; i < level->texture_count; i++)
+        texture_free(&level->textures[i]);
+    free(level->textures);
+    lights_free(&level->light_bins);
+    free(level->lights);
+    free(level->lightmap.colors);
+    free(level->lightmap.stale);
+    free(level->lightmap.moved);
+    mesh_free(&level->mesh);
+    grid_free(&level->grid);
+    free(level->visible);
+    free(level->dirty);
     free(level->walls);
     free(level);
 }
 
+// Queues the bounds a wall left or entered for the lightmap
+static inline void level_note_moved(Level* level, Vec3 lo, Vec3 hi)
+{
+    Lightmap* lm = &level->lightmap;
+    if (lm->moved_count + 2 > lm->moved_capacity)
+    {
+        lm->moved_capacity = lm->moved_capacity ? lm->moved_capacity * 2 : 32;
+        lm->moved = (Vec3*)realloc(lm->moved, sizeof(Vec3) * lm->moved_capacity);
+    }
+    lm->moved[lm->moved_count++] = lo;
+    lm->moved[lm->moved_count++] = hi;
+}
+
+static inline void level_bake(Level* level)
+{
+    if (level->dirty_count == 0) return;
+
+    int old_count = level->mesh.quad_count;
+    mesh_reserve(&level->mesh, level->wall_count);
+    level->mesh.quad_count = level->wall_count;
+    for (int i = 0; i < level->wall_count; i++)
+    {
+        if (!level->dirty[i]) continue;
+        Wall* w = &level->walls[i];
+        if (i < old_count) level_note_moved(level, level->mesh.bounds[i * 2], level->mesh.bounds[i * 2 + 1]);
+        mesh_set_rect(&level->mesh, i,
+            w->pos,
+            w->width,
+            w->height,
+            w->angle,
+            w->color,
+            w->texture,
+            w->type,
+            w->flip_culling);
+        level_note_moved(level, level->mesh.bounds[i * 2], level->mesh.bounds[i * 2 + 1]);
+        grid_update(&level->grid, i, level->mesh.bounds[i * 2], level->mesh.bounds[i * 2 + 1]);
+        level->dirty[i] = 0;
+    }
+    level->dirty_count = 0;
+}
+
+// Walls in grid cells overlapping the view frustum; exact culling happens
+// per quad in mesh_render
+static inline int level_query_frustum(Level* level, const View* view, int* out)
+{
+    Grid* grid = &level->grid;
+    int count = 0;
+    int cx0 = grid_cell(view->frustum_lo.x), cx1 = grid_cell(view->frustum_hi.x);
+    int cz0 = grid_cell(view->frustum_lo.z), cz1 = grid_cell(view->frustum_hi.z);
+
+    grid_begin_query(grid);
+    for (int cz = cz0; cz <= cz1; cz++)
+    {
+        for (int cx = cx0; cx <= cx1; cx++)
+        {
+            Vec3 lo = { cx * GRID_CELL_SIZE, grid->min_y, cz * GRID_CELL_SIZE };
+            Vec3 hi = { lo.x + GRID_CELL_SIZE, grid->max_y, lo.z + GRID_CELL_SIZE };
+            if (aabb_outside_planes(view->frustum, 6, lo, hi)) continue;
+
+            GridBucket* b = grid_bucket(grid, cx, cz);
+            for (int i = 0; i < b->count; i++)
+                if (grid_visit(grid, b->items[i])) out[count++] = b->items[i];
+        }
+    }
+    return count;
+}
+
+// Segment a wall covers on the map: opposite corners of its quad
+static inline float level_wall_distance(const Level* level, int index, float x, float z)
+{
+    const Vec3* v = &level->mesh.verts[index * 4];
+    float vx = v[2].x - v[0].x, vz = v[2].z - v[0].z;
+    float wx = x - v[0].x, wz = z - v[0].z;
+    float vv = vx*vx + vz*vz;
+    if (vv < 1e-6f) vv = 1.0f;
+    float t = fmaxf(0.0f, fminf(1.0f, (vx*wx + vz*wz) / vv));
+    float dx = wx - t * vx, dz = wz - t * vz;
+    return sqrtf(dx*dx + dz*dz);
+}
+
+#define LEVEL_PICK_MAX_RINGS 32
+
+// Nearest non-floor wall to (x, z) within max_dist, searched ring by ring
+// outwards from the point's cell. Returns -1 when nothing is in range.
+static inline int level_pick_wall(Level* level, float x, float z, float max_dist, float* out_dist)
+{
+    level_bake(level);
+    Grid* grid = &level->grid;
+    int best = -1;
+    float best_dist = max_dist;
+
+    int rings = (int)(max_dist / GRID_CELL_SIZE) + 1;
+    if (rings > LEVEL_PICK_MAX_RINGS)
+    {
+        // Zoomed far out: the radius spans more cells than there are walls
+        for (int i = 0; i < level->wall_count; i++)
+        {
+            if (level->walls[i].type == FLOOR) continue;
+            float d = level_wall_distance(level, i, x, z);
+            if (d < best_dist) { best_dist = d; best = i; }
+        }
+        if (out_dist) *out_dist = best_dist;
+        return best;
+    }
+
+    int ccx = grid_cell(x), ccz = grid_cell(z);
+    grid_begin_query(grid);
+    for (int r = 0; r <= rings; r++)
+    {
+        // Anything in ring r is at least (r - 1) cells away
+        if (best >= 0 && best_dist <= (r - 1) * GRID_CELL_SIZE) break;
+        for (int cz = ccz - r; cz <= ccz + r; cz++)
+        {
+            for (int cx = ccx - r; cx <= ccx + r; cx++)
+            {
+                if (abs(cx - ccx) != r && abs(cz - ccz) != r) continue;
+                GridBucket* b = grid_bucket(grid, cx, cz);
+                for (int i = 0; i < b->count; i++)
+                {
+                    int w = b->items[i];
+                    if (!grid_visit(grid, w) || level->walls[w].type == FLOOR) continue;
+                    float d = level_wall_distance(level, w, x, z);
+                    if (d < best_dist) { best_dist = d; best = w; }
+                }
+            }
+        }
+    }
+    if (out_dist) *out_dist = best_dist;
+    return best;
+}
+
+// Both-sided ray/quad test against a baked wall quad
+static inline int level_ray_quad(const Level* level, int index, Vec3 origin, Vec3 dir, float* out_t)
+{
+    const Vec3* v = &level->mesh.verts[index * 4];
+    Vec3 n = level->mesh.normals[index];
+    float denom = vec3_dot(n, dir);
+    if (fabsf(denom) < 1e-8f) return 0;
+    float t = vec3_dot(n, vec3_sub(v[0], origin)) / denom;
+    if (t < 0.0f) return 0;
+
+    Vec3 p = vec3_add(origin, vec3_scale(dir, t));
+    for (int i = 0; i < 4; i++)
+    {
+        Vec3 e = vec3_sub(v[(i + 1) & 3], v[i]);
+        if (vec3_dot(vec3_cross(e, vec3_sub(p, v[i])), n) < 0.0f) return 0;
+    }
+    *out_t = t;
+    return 1;
+}
+
+// Closest wall hit along origin + t * dir for t in [0, max_t], walking the
+// grid cells the ray crosses in XZ. Returns -1 on a miss.
+static inline int level_raycast(Level* level, Vec3 origin, Vec3 dir, float max_t, float* out_t)
+{
+    level_bake(level);
+    Grid* grid = &level->grid;
+    int best = -1;
+    float best_t = max_t;
+
+    int cx = grid_cell(origin.x), cz = grid_cell(origin.z);
+    int step_x = (dir.x > 0.0f) ? 1 : -1;
+    int step_z = (dir.z > 0.0f) ? 1 : -1;
+    float inv_x = (fabsf(dir.x) > 1e-12f) ? 1.0f / dir.x : 0.0f;
+    float inv_z = (fabsf(dir.z) > 1e-12f) ? 1.0f / dir.z : 0.0f;
+    float next_x = inv_x != 0.0f ? ((cx + (step_x > 0)) * GRID_CELL_SIZE - origin.x) * inv_x : 1e30f;
+    float next_z = inv_z != 0.0f ? ((cz + (step_z > 0)) * GRID_CELL_SIZE - origin.z) * inv_z : 1e30f;
+    float delta_x = inv_x != 0.0f ? GRID_CELL_SIZE * fabsf(inv_x) : 1e30f;
+    float delta_z = inv_z != 0.0f ? GRID_CELL_SIZE * fabsf(inv_z) : 1e30f;
+
+    grid_begin_query(grid);
+    float t_enter = 0.0f;
+    while (t_enter <= best_t)
+    {
+        GridBucket* b = grid_bucket(grid, cx, cz);
+        for (int i = 0; i < b->count; i++)
+        {
+            int w = b->items[i];
+            if (!grid_visit(grid, w)) continue;
+            float t;
+            if (level_ray_quad(level, w, origin, dir, &t) && t < best_t)
+            {
+                best_t = t;
+                best = w;
+            }
+        }
+
+        if (next_x < next_z) { t_enter = next_x; next_x += delta_x; cx += step_x; }
+        else                 { t_enter = next_z; next_z += delta_z; cz += step_z; }
+        if (t_enter >= 1e30f) break;
+    }
+    if (out_t) *out_t = best_t;
+    return best;
+}
+
 static inline Level* level_load_from_file(const char* filename)
 {
     FILE* f = fopen(filename, "r");
     Level* level = level_create(16);
+    if (!f)
+    {
+        printf("[ERROR] Couldn't open level %s\n", filename);
+        return level;
+    }
+
+    // Texture files are found next to the level
+    char dir[256] = "";
+    const char* slash = strrchr(filename, '/');
+    if (slash && slash - filename + 1 < (int)sizeof(dir))
+    {
+        memcpy(dir, filename, slash - filename + 1);
+        dir[slash - filename + 1] = '\0';
+    }
 
     char line[256];
     int line_num = 0;
@@ -44,17 +350,42 @@ static inline Level* level_load_from_file(const char* filename)
         if (line[0] == '\n' || line[0] == '#' || line[0] == '\0')
             continue;
 
+        // LIGHT x y z radius color intensity
+        if (strncmp(line, "LIGHT ", 6) == 0)
+        {
+            PointLight light = { .color = 0xFFFFFFFF, .intensity = 1.0f };
+            int parsed = sscanf(line + 6, "%f %f %f %f %x %f",
+                &light.position.x, &light.position.y, &light.position.z,
+                &light.radius, &light.color, &light.intensity);
+            if (parsed < 4 || light.radius <= 0.0f)
+                printf("[ERROR] Bad light on line %d of %s\n", line_num, filename);
+            else
+                level_add_light(level, light);
+            continue;
+        }
+
+        // GROUND_TEXTURE name
+        char texture_name[TEXTURE_NAME];
+        if (strncmp(line, "GROUND_TEXTURE ", 15) == 0)
+        {
+            if (sscanf(line + 15, "%31s", texture_name) == 1)
+                level->ground_texture = level_texture(level, texture_name, dir);
+            continue;
+        }
+
         Wall wall = {};
         char type_str[16];
-        int parsed = sscanf(line, "%f %f %f %f %f %f %s %x %d",
+        int parsed = sscanf(line, "%f %f %f %f %f %f %s %x %d %31s",
             &wall.pos.x, &wall.pos.y, &wall.pos.z,
             &wall.width, &wall.height, &wall.angle,
-            type_str, &wall.color, &wall.flip_culling);
+            type_str, &wall.color, &wall.flip_culling, texture_name);
 
         if (parsed < 8)
             wall.color = 0xFFCCCCCC;
         if (parsed < 9)
             wall.flip_culling = 0;
+        if (parsed >= 10)
+            wall.texture = level_texture(level, texture_name, dir);
 
         if (strcmp(type_str, "WALL_X") == 0 ||
             strcmp(type_str, "WALLX ") == 0) wall.type = WALL_X;
@@ -66,7 +397,7 @@ static inline Level* level_load_from_file(const char* filename)
     }
 
     fclose(f);
-    printf("[LOG] Loaded %d walls from %s\n", level->wall_count, filename);
+    printf("[LOG] Loaded %d walls and %d lights from %s\n", level->wall_count, level->light_count, filename);
     return level;
 }
 
@@ -74,42 +405,97 @@ static inline int level_save_to_file(const Level* level, const char* filename)
 {
     FILE* f = fopen(filename, "w");
     if (!f) return 0;
+    const char* ground = level_texture_name(level, level->ground_texture);
+    if (ground) fprintf(f, "GROUND_TEXTURE %s\n", ground);
     for (int i = 0; i < level->wall_count; ++i)
     {
         const Wall* w = &level->walls[i];
         const char* t =
             (w->type == FLOOR) ? "FLOOR" :
             (w->type == WALL_X) ? "WALL_X" : "WALL_Z";
-        // pos.x pos.y pos.z width height angle type color flip_culling
-        fprintf(f, "%.6f %.6f %.6f %.6f %.6f %.6f %s %08X %d\n",
+        const char* texture = level_texture_name(level, w->texture);
+        // pos.x pos.y pos.z width height angle type color flip_culling [texture]
+        fprintf(f, "%.6f %.6f %.6f %.6f %.6f %.6f %s %08X %d%s%s\n",
             w->pos.x, w->pos.y, w->pos.z,
             w->width, w->height, w->angle,
-            t, (unsigned)w->color, w->flip_culling);
+            t, (unsigned)w->color, w->flip_culling,
+            texture ? " " : "", texture ? texture : "");
+    }
+    for (int i = 0; i < level->light_count; ++i)
+    {
+        const PointLight* l = &level->lights[i];
+        fprintf(f, "LIGHT %.6f %.6f %.6f %.6f %08X %.6f\n",
+            l->position.x, l->position.y, l->position.z,
+            l->radius, (unsigned)l->color, l->intensity);
     }
     fclose(f);
     return 1;
 }
 
+// Deterministic stress level: count walls scattered over a 4000 x 4000
+// square on the floor, same numbers on every platform, and a point light
+// per 200 walls drawn after them so the walls match older builds
+static inline Level* level_generate(int count, uint32_t seed)
+{
+    static const uint32_t palette[] = { 0xFFFFFFFF, 0xFFCC4A4A, 0xFF3B82F6, 0xFFEAD14B, 0xFF9CA3AF };
+    Level* level = level_create(count > 16 ? count : 16);
+    uint32_t state = seed ? seed : 1;
+
+    for (int i = 0; i < count; i++)
+    {
+        float r[6];
+        for (int k = 0; k < 6; k++)
+        {
+            state = state * 1664525u + 1013904223u;
+            r[k] = (float)(state >> 8) / 16777216.0f;
+        }
+
+        Wall wall = {};
+        wall.pos = (Vec3){ -2000.0f + r[0] * 4000.0f, -32.0f, -1000.0f + r[1] * 4000.0f };
+        wall.width = 40.0f + r[2] * 160.0f;
+        wall.height = 100.0f;
+        wall.angle = r[3] * 2.0f * (float)M_PI;
+        wall.type = (r[4] < 0.5f) ? WALL_X : WALL_Z;
+        wall.color = palette[(int)(r[5] * 5.0f) % 5];
+        wall.flip_culling = (state >> 4) & 1;
+        level_add_wall(level, wall);
+    }
+
+    for (int i = 0; i < count / 200; i++)
+    {
+        float r[4];
+        for (int k = 0; k < 4; k++)
+        {
+            state = state * 1664525u + 1013904223u;
+            r[k] = (float)(state >> 8) / 16777216.0f;
+        }
+
+        PointLight light = {};
+        light.position = (Vec3){ -2000.0f + r[0] * 4000.0f, 40.0f, -1000.0f + r[1] * 4000.0f };
+        light.radius = 150.0f + r[2] * 150.0f;
+        light.color = palette[1 + (int)(r[3] * 4.0f) % 4];
+        light.intensity = 1.0f;
+        level_add_light(level, light);
+    }
+
+    printf("[LOG] Generated %d walls and %d lights (seed %u)\n", count, level->light_count, seed);
+    return level;
+}
+
 static inline void level_render(
     Level* level,
-    buffer* buf,
-    Olivec_Canvas oc,
+    Raster* rs,
     Light light,
-    Camera cam)
+    const View* view)
 {
-    for (int i = 0; i < level->wall_count; i++)
-    {
-        Wall* w = &level->walls[i];
-        place_rect(buf, oc,
-            w->pos,
-            w->width,
-            w->height,
-            w->angle,
-            w->color,
-            w->type,
-            w->flip_culling,
-            light, cam);
-    }
+    level_bake(level);
+    int count = level_query_frustum(level, view, level->visible);
+    rs->stats.objects_tested += level->wall_count - count;
+    rs->stats.objects_culled += level->wall_count - count;
+    const Lightmap* lm = &level->lightmap;
+    const uint32_t* baked = (lm->valid && lm->enabled && g_light_active) ? lm->colors : NULL;
+    LightBins* bins = level->light_count ? &level->light_bins : NULL;
+    mesh_render(&level->mesh, level->visible, count, rs, light, view, baked, bins, level->textures);
 }
 
 #endif // LEVEL_H
@@ -0,0 +1,342 @@
+#ifndef LIGHTMAP_H
+#define LIGHTMAP_H
+
+#include "game.h"
+#include "util.h"
+#include "level.h"
+
+// Wall lighting baked per sample instead of recomputed per triangle every
+// frame: the diffuse term with a shadow ray through level_raycast, and
+// ambient occlusion from short rays over the hemisphere. Only fog is left
+// for the frame. The ground is not a wall and keeps its own lighting.
+#define LIGHTMAP_INSET 2.0f          // corner samples are pulled this far inwards
+#define LIGHTMAP_AO_RAYS 12
+#define LIGHTMAP_AO_RANGE 64.0f
+#define LIGHTMAP_AO_STRENGTH 0.8f
+#define LIGHTMAP_SUN_DISTANCE 10000.0f
+#define LIGHTMAP_MAX_MOVED 64        // rebuilt walls past which everything is baked
+#define LIGHTMAP_MAX_NEAR 64         // occluders tested directly, beyond this the grid walks
+
+static inline void lightmap_reserve(Lightmap *lm, int quads)
+{
+    if (quads <= lm->capacity) return;
+    int capacity = lm->capacity ? lm->capacity : 16;
+    while (capacity < quads) capacity *= 2;
+    lm->colors = (uint32_t *)realloc(lm->colors, sizeof(uint32_t) * LIGHTMAP_SAMPLES * capacity);
+    lm->stale = (uint8_t *)realloc(lm->stale, sizeof(uint8_t) * capacity);
+    memset(lm->stale + lm->capacity, 0, capacity - lm->capacity);
+    lm->capacity = capacity;
+}
+
+// Sample positions of quad q: the corners, then the triangle centers
+static inline void lightmap_samples(const Mesh *mesh, int q, Vec3 out[LIGHTMAP_SAMPLES])
+{
+    const Vec3 *v = &mesh->verts[q * 4];
+    Vec3 center = vec3_scale(vec3_add(vec3_add(v[0], v[1]), vec3_add(v[2], v[3])), 0.25f);
+    for (int i = 0; i < 4; i++)
+    {
+        Vec3 d = vec3_sub(center, v[i]);
+        float len = sqrtf(vec3_dot(d, d));
+        out[i] = len > 2.0f * LIGHTMAP_INSET ? vec3_add(v[i], vec3_scale(d, LIGHTMAP_INSET / len)) : center;
+    }
+    out[4] = vec3_scale(vec3_add(vec3_add(v[0], v[1]), v[2]), 1.0f / 3.0f);
+    out[5] = vec3_scale(vec3_add(vec3_add(v[0], v[2]), v[3]), 1.0f / 3.0f);
+}
+
+// Cosine-weighted directions around +z on a golden angle spiral, so the
+// plain average of the rays weighs them like diffuse light
+static inline void lightmap_hemisphere(Vec3 out[LIGHTMAP_AO_RAYS])
+{
+    for (int i = 0; i < LIGHTMAP_AO_RAYS; i++)
+    {
+        float r = sqrtf((i + 0.5f) / LIGHTMAP_AO_RAYS);
+        float phi = i * 2.39996323f;
+        out[i] = (Vec3){ r * cosf(phi), r * sinf(phi), sqrtf(1.0f - r * r) };
+    }
+}
+
+// Squared distance from p to the box [lo, hi]
+static inline float lightmap_box_distance_sq(Vec3 p, Vec3 lo, Vec3 hi)
+{
+    float dx = fmaxf(fmaxf(lo.x - p.x, 0.0f), p.x - hi.x);
+    float dy = fmaxf(fmaxf(lo.y - p.y, 0.0f), p.y - hi.y);
+    float dz = fmaxf(fmaxf(lo.z - p.z, 0.0f), p.z - hi.z);
+    return dx * dx + dy * dy + dz * dz;
+}
+
+// Quads the occlusion rays of quad q can reach: near its bounds and not
+// wholly behind its plane
+static inline int lightmap_neighbours(Level *level, int q, int *out)
+{
+    Grid *grid = &level->grid;
+    const Mesh *mesh = &level->mesh;
+    float reach = LIGHTMAP_AO_RANGE + SHADOW_NORMAL_OFFSET;
+    Vec3 lo = vec3_sub(mesh->bounds[q * 2], (Vec3){ reach, reach, reach });
+    Vec3 hi = vec3_add(mesh->bounds[q * 2 + 1], (Vec3){ reach, reach, reach });
+    Vec3 n = mesh->normals[q];
+    float plane = vec3_dot(n, mesh->verts[q * 4]);
+
+    int count = 0;
+    grid_begin_query(grid);
+    for (int cz = grid_cell(lo.z); cz <= grid_cell(hi.z); cz++)
+    {
+        for (int cx = grid_cell(lo.x); cx <= grid_cell(hi.x); cx++)
+        {
+            GridBucket *bucket = grid_bucket(grid, cx, cz);
+            for (int i = 0; i < bucket->count; i++)
+            {
+                int w = bucket->items[i];
+                if (w == q || !grid_visit(grid, w)) continue;
+                Vec3 wlo = mesh->bounds[w * 2], whi = mesh->bounds[w * 2 + 1];
+                if (wlo.x > hi.x || whi.x < lo.x || wlo.y > hi.y || whi.y < lo.y || wlo.z > hi.z || whi.z < lo.z)
+                    continue;
+
+                // Corner furthest along the normal
+                Vec3 front = { n.x >= 0.0f ? whi.x : wlo.x, n.y >= 0.0f ? whi.y : wlo.y, n.z >= 0.0f ? whi.z : wlo.z };
+                if (vec3_dot(n, front) <= plane) continue;
+                out[count++] = w;
+            }
+        }
+    }
+    return count;
+}
+
+// A wall rectangle set up for rays from one origin: the ray hits at
+// t = dist / dot(n, dir), where the rectangle's own coordinates are
+// t * dot(dir, eu) - u0 and t * dot(dir, ev) - v0, both within 0..1
+typedef struct
+{
+    Vec3 n;
+    Vec3 eu;
+    Vec3 ev;
+    float dist;
+    float u0;
+    float v0;
+}
+LightmapOccluder;
+
+static inline LightmapOccluder lightmap_occluder(const Mesh *mesh, int q, Vec3 origin)
+{
+    const Vec3 *v = &mesh->verts[q * 4];
+    Vec3 u = vec3_sub(v[1], v[0]);
+    Vec3 w = vec3_sub(v[3], v[0]);
+    Vec3 rel = vec3_sub(v[0], origin);
+    LightmapOccluder o;
+    o.n = mesh->normals[q];
+    o.eu = vec3_scale(u, 1.0f / vec3_dot(u, u));
+    o.ev = vec3_scale(w, 1.0f / vec3_dot(w, w));
+    o.dist = vec3_dot(o.n, rel);
+    o.u0 = vec3_dot(rel, o.eu);
+    o.v0 = vec3_dot(rel, o.ev);
+    return o;
+}
+
+// Lit color at sample p of a wall with normal n and tangents t, b. The
+// occlusion rays test the near occluders when count >= 0, else walk the grid.
+static inline uint32_t lightmap_shade(Level *level, Vec3 p, Vec3 n, Vec3 t, Vec3 b, uint32_t c, Light light, int shadows, const Vec3 *hemisphere, const LightmapOccluder *near, int count)
+{
+    Vec3 origin = vec3_add(p, vec3_scale(n, SHADOW_NORMAL_OFFSET));
+    Vec3 light_dir = light_direction(p, light);
+    float diffuse = fmaxf(0.0f, vec3_dot(n, light_dir));
+    if (diffuse > 0.0f && shadows)
+    {
+        float max_t = light.is_directional ? LIGHTMAP_SUN_DISTANCE : vec3_distance(origin, light.position);
+        if (level_raycast(level, origin, light_dir, max_t, NULL) >= 0) diffuse = 0.0f;
+    }
+
+    // Near hits occlude more than hits at the edge of the range
+    float occlusion = 0.0f;
+    for (int i = 0; i < LIGHTMAP_AO_RAYS; i++)
+    {
+        Vec3 h = hemisphere[i];
+        Vec3 dir = vec3_add(vec3_add(vec3_scale(t, h.x), vec3_scale(b, h.y)), vec3_scale(n, h.z));
+        float hit = LIGHTMAP_AO_RANGE;
+        if (count < 0)
+        {
+            level_raycast(level, origin, dir, LIGHTMAP_AO_RANGE, &hit);
+        }
+        else
+        {
+            for (int k = 0; k < count; k++)
+            {
+                const LightmapOccluder *o = &near[k];
+                float denom = vec3_dot(o->n, dir);
+                if (fabsf(denom) < 1e-8f) continue;
+                float d = o->dist / denom;
+                if (d < 0.0f || d >= hit) continue;
+                float u = d * vec3_dot(dir, o->eu) - o->u0;
+                float v = d * vec3_dot(dir, o->ev) - o->v0;
+                if (u >= 0.0f && u <= 1.0f && v >= 0.0f && v <= 1.0f) hit = d;
+            }
+        }
+        occlusion += 1.0f - hit / LIGHTMAP_AO_RANGE;
+    }
+    float ambient = LIGHT_AMBIENT * (1.0f - LIGHTMAP_AO_STRENGTH * occlusion / LIGHTMAP_AO_RAYS);
+
+    float intensity = ambient + diffuse * light.intensity * (1.0f - LIGHT_AMBIENT);
+    return light_color(c, intensity, light);
+}
+
+static inline void lightmap_bake_quad(Level *level, int q, Light light, int shadows, const Vec3 *hemisphere)
+{
+    const Mesh *mesh = &level->mesh;
+    Vec3 n = mesh->normals[q];
+    Vec3 axis = fabsf(n.y) < 0.9f ? (Vec3){ 0.0f, 1.0f, 0.0f } : (Vec3){ 1.0f, 0.0f, 0.0f };
+    Vec3 t = vec3_normalize(vec3_cross(n, axis));
+    Vec3 b = vec3_cross(n, t);
+
+    // level->visible is free scratch outside level_render
+    int *candidates = level->visible;
+    int candidate_count = lightmap_neighbours(level, q, candidates);
+
+    Vec3 samples[LIGHTMAP_SAMPLES];
+    lightmap_samples(mesh, q, samples);
+    uint32_t *out = &level->lightmap.colors[q * LIGHTMAP_SAMPLES];
+    for (int k = 0; k < LIGHTMAP_SAMPLES; k++)
+    {
+        // Only quads within range of this sample
+        Vec3 origin = vec3_add(samples[k], vec3_scale(n, SHADOW_NORMAL_OFFSET));
+        LightmapOccluder near[LIGHTMAP_MAX_NEAR];
+        int count = 0;
+        for (int i = 0; i < candidate_count && count >= 0; i++)
+        {
+            int w = candidates[i];
+            if (lightmap_box_distance_sq(origin, mesh->bounds[w * 2], mesh->bounds[w * 2 + 1]) > LIGHTMAP_AO_RANGE * LIGHTMAP_AO_RANGE) continue;
+            if (count == LIGHTMAP_MAX_NEAR) count = -1;
+            else near[count++] = lightmap_occluder(mesh, w, origin);
+        }
+        out[k] = lightmap_shade(level, samples[k], n, t, b, mesh->colors[q], light, shadows, hemisphere, near, count);
+    }
+}
+
+// Slab test of the segment from a to b against the box [lo, hi]
+static inline int lightmap_segment_hits_box(Vec3 a, Vec3 b, Vec3 lo, Vec3 hi)
+{
+    float t0 = 0.0f, t1 = 1.0f;
+    float from[3] = { a.x, a.y, a.z };
+    float to[3] = { b.x, b.y, b.z };
+    float min[3] = { lo.x, lo.y, lo.z };
+    float max[3] = { hi.x, hi.y, hi.z };
+    for (int i = 0; i < 3; i++)
+    {
+        float d = to[i] - from[i];
+        if (fabsf(d) < 1e-12f)
+        {
+            if (from[i] < min[i] || from[i] > max[i]) return 0;
+            continue;
+        }
+        float n = (min[i] - from[i]) / d;
+        float f = (max[i] - from[i]) / d;
+        if (n > f) { float tmp = n; n = f; f = tmp; }
+        t0 = fmaxf(t0, n);
+        t1 = fminf(t1, f);
+        if (t0 > t1) return 0;
+    }
+    return 1;
+}
+
+// Marks the quads a wall leaving or entering [lo, hi] can change: those
+// within reach of the occlusion rays and those whose shadow rays cross it
+static inline void lightmap_mark_moved(Level *level, Vec3 lo, Vec3 hi, Light light)
+{
+    Lightmap *lm = &level->lightmap;
+    const Mesh *mesh = &level->mesh;
+    float reach = LIGHTMAP_AO_RANGE + SHADOW_NORMAL_OFFSET;
+    Vec3 near_lo = vec3_sub(lo, (Vec3){ reach, reach, reach });
+    Vec3 near_hi = vec3_add(hi, (Vec3){ reach, reach, reach });
+
+    for (int q = 0; q < mesh->quad_count; q++)
+    {
+        if (lm->stale[q]) continue;
+        Vec3 qlo = mesh->bounds[q * 2], qhi = mesh->bounds[q * 2 + 1];
+        int hit = qlo.x <= near_hi.x && qhi.x >= near_lo.x
+               && qlo.y <= near_hi.y && qhi.y >= near_lo.y
+               && qlo.z <= near_hi.z && qhi.z >= near_lo.z;
+
+        Vec3 samples[LIGHTMAP_SAMPLES];
+        if (!hit) lightmap_samples(mesh, q, samples);
+        for (int k = 0; k < LIGHTMAP_SAMPLES && !hit; k++)
+        {
+            Vec3 to = light.is_directional
+                ? vec3_add(samples[k], vec3_scale(vec3_neg(light.direction), LIGHTMAP_SUN_DISTANCE))
+                : light.position;
+            hit = lightmap_segment_hits_box(samples[k], to, lo, hi);
+        }
+        if (hit)
+        {
+            lm->stale[q] = 1;
+            lm->stale_count++;
+        }
+    }
+}
+
+static inline int lightmap_key_changed(const Lightmap *lm, Light light, int shadows)
+{
+    return lm->light_directional != light.is_directional
+        || lm->light_color != light.color
+        || lm->shadows != shadows
+        || memcmp(&lm->light_intensity, &light.intensity, sizeof(float)) != 0
+        || memcmp(&lm->light_position, &light.position, sizeof(Vec3)) != 0
+        || memcmp(&lm->light_direction, &light.direction, sizeof(Vec3)) != 0;
+}
+
+// Brings the baked colors up to date with light and the walls. Changing
+// the light bakes every wall again, a rebuilt wall only those it affects.
+static inline void lightmap_update(Level *level, Light light)
+{
+    Lightmap *lm = &level->lightmap;
+    level_bake(level);
+
+    // Switched off, the moves are kept for later unless there are so many
+    // that everything has to be baked anyway
+    if (!lm->enabled || !g_light_active)
+    {
+        if (lm->moved_count / 2 > LIGHTMAP_MAX_MOVED)
+        {
+            lm->valid = 0;
+            lm->moved_count = 0;
+        }
+        return;
+    }
+
+    int count = level->mesh.quad_count;
+    int shadows = light.shadow && light.shadow->enabled;
+    lightmap_reserve(lm, count);
+    int full = !lm->valid || lightmap_key_changed(lm, light, shadows) || lm->moved_count / 2 > LIGHTMAP_MAX_MOVED;
+    if (full)
+    {
+        memset(lm->stale, 1, count);
+        lm->stale_count = count;
+    }
+    else
+    {
+        for (int i = 0; i < lm->moved_count; i += 2)
+            lightmap_mark_moved(level, lm->moved[i], lm->moved[i + 1], light);
+    }
+    lm->moved_count = 0;
+
+    lm->light_position = light.position;
+    lm->light_direction = light.direction;
+    lm->light_color = light.color;
+    lm->light_intensity = light.intensity;
+    lm->light_directional = light.is_directional;
+    lm->shadows = shadows;
+    lm->valid = 1;
+    if (lm->stale_count == 0) return;
+
+    uint64_t start = NANO();
+    Vec3 hemisphere[LIGHTMAP_AO_RAYS];
+    lightmap_hemisphere(hemisphere);
+    int baked = 0;
+    for (int q = 0; q < count; q++)
+    {
+        if (!lm->stale[q]) continue;
+        lightmap_bake_quad(level, q, light, shadows, hemisphere);
+        lm->stale[q] = 0;
+        baked++;
+    }
+    lm->stale_count = 0;
+    if (full) printf("[LOG] Baked lighting for %d walls in %.1f ms\n", baked, (NANO() - start) / 1e6);
+}
+
+#endif // LIGHTMAP_H
@@ -0,0 +1,223 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "game.h"
+#include "grid.h"
+
+// Lights gathered for one wall; further lights reaching it are dropped
+#define LIGHTS_MAX_PER_WALL 16
+
+// Rebuilds the bins for the current light positions: a counting pass, a
+// prefix sum and a fill pass, one bucket entry per light however many of
+// its cells share the bucket
+static inline void lights_bin(LightBins *bins, const PointLight *lights, int count)
+{
+    bins->lights = lights;
+    bins->light_count = count;
+
+    int last[GRID_BUCKETS];
+    int fill[GRID_BUCKETS];
+    memset(bins->offsets, 0, sizeof(bins->offsets));
+    memset(last, 0xFF, sizeof(last));
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int l = 0; l < count; l++)
+        {
+            const PointLight *light = &lights[l];
+            int cx0 = grid_cell(light->position.x - light->radius), cx1 = grid_cell(light->position.x + light->radius);
+            int cz0 = grid_cell(light->position.z - light->radius), cz1 = grid_cell(light->position.z + light->radius);
+            for (int cz = cz0; cz <= cz1; cz++)
+            {
+                for (int cx = cx0; cx <= cx1; cx++)
+                {
+                    int b = grid_hash(cx, cz);
+                    if (last[b] == l) continue;
+                    last[b] = l;
+                    if (pass == 0) bins->offsets[b + 1]++;
+                    else bins->items[fill[b]++] = l;
+                }
+            }
+        }
+        if (pass == 1) break;
+
+        for (int b = 0; b < GRID_BUCKETS; b++)
+            bins->offsets[b + 1] += bins->offsets[b];
+        int total = bins->offsets[GRID_BUCKETS];
+        if (total > bins->item_capacity)
+        {
+            bins->item_capacity = total * 2;
+            bins->items = (int *)realloc(bins->items, sizeof(int) * bins->item_capacity);
+        }
+        memcpy(fill, bins->offsets, sizeof(fill));
+        memset(last, 0xFF, sizeof(last));
+    }
+
+    if (count > bins->stamp_capacity)
+    {
+        bins->stamp_capacity = count * 2;
+        bins->stamp = (uint32_t *)realloc(bins->stamp, sizeof(uint32_t) * bins->stamp_capacity);
+        memset(bins->stamp, 0, sizeof(uint32_t) * bins->stamp_capacity);
+        bins->query = 0;
+    }
+}
+
+// Bins the lights by the tiles of a floor at floor_y, tiles_x by tiles_z
+// tiles of tile_size from (origin_x, origin_z), that they reach
+static inline void lights_bin_floor(LightBins *bins, float origin_x, float origin_z, float tile_size, int tiles_x, int tiles_z, float floor_y)
+{
+    int tiles = tiles_x * tiles_z;
+    if (tiles + 1 > bins->tile_capacity)
+    {
+        bins->tile_capacity = tiles + 1;
+        bins->tile_offsets = (int *)realloc(bins->tile_offsets, sizeof(int) * bins->tile_capacity);
+    }
+    bins->tiles_x = tiles_x;
+    memset(bins->tile_offsets, 0, sizeof(int) * (tiles + 1));
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int l = 0; l < bins->light_count; l++)
+        {
+            const PointLight *light = &bins->lights[l];
+            Vec3 p = light->position;
+            float dy = floor_y - p.y;
+            float reach_sq = light->radius * light->radius - dy * dy;
+            if (reach_sq <= 0.0f) continue;
+
+            int ix0 = (int)floorf((p.x - light->radius - origin_x) / tile_size);
+            int ix1 = (int)floorf((p.x + light->radius - origin_x) / tile_size);
+            int iz0 = (int)floorf((p.z - light->radius - origin_z) / tile_size);
+            int iz1 = (int)floorf((p.z + light->radius - origin_z) / tile_size);
+            if (ix0 < 0) ix0 = 0;
+            if (iz0 < 0) iz0 = 0;
+            if (ix1 >= tiles_x) ix1 = tiles_x - 1;
+            if (iz1 >= tiles_z) iz1 = tiles_z - 1;
+            for (int iz = iz0; iz <= iz1; iz++)
+            {
+                float z0 = origin_z + iz * tile_size;
+                float dz = fmaxf(fmaxf(z0 - p.z, 0.0f), p.z - (z0 + tile_size));
+                for (int ix = ix0; ix <= ix1; ix++)
+                {
+                    float x0 = origin_x + ix * tile_size;
+                    float dx = fmaxf(fmaxf(x0 - p.x, 0.0f), p.x - (x0 + tile_size));
+                    if (dx * dx + dz * dz >= reach_sq) continue;
+                    int t = iz * tiles_x + ix;
+                    if (pass == 0) bins->tile_offsets[t + 1]++;
+                    else bins->tile_items[bins->tile_offsets[t]++] = l;
+                }
+            }
+        }
+        if (pass == 1) break;
+
+        // Tile starts; the fill pass advances each to the tile's end, so
+        // the array is shifted up one afterwards
+        for (int t = 0; t < tiles; t++)
+            bins->tile_offsets[t + 1] += bins->tile_offsets[t];
+        int total = bins->tile_offsets[tiles];
+        if (total > bins->tile_item_capacity)
+        {
+            bins->tile_item_capacity = total * 2;
+            bins->tile_items = (int *)realloc(bins->tile_items, sizeof(int) * bins->tile_item_capacity);
+        }
+    }
+    memmove(bins->tile_offsets + 1, bins->tile_offsets, sizeof(int) * tiles);
+    bins->tile_offsets[0] = 0;
+}
+
+// Lights reaching floor tile (ix, iz). Read-only, so the raster workers
+// can call it.
+static inline LightList lights_floor_tile(const LightBins *bins, int ix, int iz)
+{
+    int t = iz * bins->tiles_x + ix;
+    LightList list = { bins->lights, bins->tile_items + bins->tile_offsets[t], bins->tile_offsets[t + 1] - bins->tile_offsets[t] };
+    return list;
+}
+
+static inline void lights_free(LightBins *bins)
+{
+    free(bins->items);
+    free(bins->stamp);
+    free(bins->tile_offsets);
+    free(bins->tile_items);
+    *bins = (LightBins){0};
+}
+
+// Lights whose radius reaches the box [lo, hi], written to out
+static inline int lights_gather(LightBins *bins, Vec3 lo, Vec3 hi, int *out)
+{
+    if (bins->light_count == 0) return 0;
+    if (++bins->query == 0)
+    {
+        memset(bins->stamp, 0, sizeof(uint32_t) * bins->stamp_capacity);
+        bins->query = 1;
+    }
+
+    int count = 0;
+    for (int cz = grid_cell(lo.z); cz <= grid_cell(hi.z); cz++)
+    {
+        for (int cx = grid_cell(lo.x); cx <= grid_cell(hi.x); cx++)
+        {
+            int b = grid_hash(cx, cz);
+            for (int i = bins->offsets[b]; i < bins->offsets[b + 1]; i++)
+            {
+                int l = bins->items[i];
+                if (bins->stamp[l] == bins->query) continue;
+                bins->stamp[l] = bins->query;
+
+                const PointLight *light = &bins->lights[l];
+                Vec3 p = light->position;
+                float dx = fmaxf(fmaxf(lo.x - p.x, 0.0f), p.x - hi.x);
+                float dy = fmaxf(fmaxf(lo.y - p.y, 0.0f), p.y - hi.y);
+                float dz = fmaxf(fmaxf(lo.z - p.z, 0.0f), p.z - hi.z);
+                if (dx * dx + dy * dy + dz * dz >= light->radius * light->radius) continue;
+                out[count++] = l;
+                if (count == LIGHTS_MAX_PER_WALL) return count;
+            }
+        }
+    }
+    return count;
+}
+
+// Diffuse light of the listed lights at p per channel, as a multiple of
+// the surface color; returns 0 when none of them reaches p
+static inline int lights_sum(Vec3 normal, Vec3 p, LightList list, float sum[3])
+{
+    sum[0] = sum[1] = sum[2] = 0.0f;
+    int reached = 0;
+    for (int i = 0; i < list.count; i++)
+    {
+        const PointLight *light = &list.lights[list.index[i]];
+        Vec3 d = vec3_sub(light->position, p);
+        float dist_sq = vec3_dot(d, d);
+        float radius_sq = light->radius * light->radius;
+        if (dist_sq >= radius_sq) continue;
+        float diffuse = vec3_dot(normal, d);
+        if (diffuse <= 0.0f) continue;
+
+        float falloff = 1.0f - dist_sq / radius_sq;
+        float k = diffuse / sqrtf(dist_sq) * falloff * falloff * light->intensity / 255.0f;
+        sum[0] += k * ((light->color >> 16) & 0xFF);
+        sum[1] += k * ((light->color >> 8) & 0xFF);
+        sum[2] += k * (light->color & 0xFF);
+        reached = 1;
+    }
+    return reached;
+}
+
+// lit plus the diffuse light of the listed lights on base_color at p
+static inline uint32_t lights_shade(uint32_t lit, uint32_t base_color, Vec3 normal, Vec3 p, LightList list)
+{
+    float sum[3];
+    if (!g_light_active || !lights_sum(normal, p, list, sum)) return lit;
+
+    uint32_t result = 0xFF000000;
+    for (int c = 0; c < 3; c++)
+    {
+        int shift = 16 - 8 * c;
+        float v = ((lit >> shift) & 0xFF) + ((base_color >> shift) & 0xFF) * sum[c];
+        result |= (uint32_t)fminf(v, 255.0f) << shift;
+    }
+    return result;
+}
+
+#endif // LIGHTS_H
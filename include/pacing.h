@@ -0,0 +1,109 @@
+#ifndef PACING_H
+#define PACING_H
+
+#include <time.h>
+#include <sched.h>
+#include "game.h"
+#include "math.h"
+
+// Sleeping this close to a deadline overshoots on a busy kernel, so the
+// last stretch is spent yielding instead
+#define PACE_SPIN_NS 1000000ull
+
+// Longest frame the simulation catches up on; beyond that time is dropped
+#define PACE_MAX_CATCHUP_NS 250000000ull
+
+typedef enum
+{
+    PACE_CAPPED,    // render at most target fps
+    PACE_UNCAPPED,  // render as fast as possible
+    PACE_PRESENT    // vsync-like: one frame in flight, paced by presentation
+}
+PaceMode;
+
+typedef struct
+{
+    PaceMode mode;
+    uint64_t interval;
+    uint64_t next;
+}
+FrameLimiter;
+
+static inline void sleep_until(uint64_t deadline)
+{
+    uint64_t now = NANO();
+    if (deadline > now + PACE_SPIN_NS)
+    {
+        // Relative, as macOS has no clock_nanosleep; the yield loop absorbs
+        // whatever the sleep over- or undershoots
+        uint64_t wait = deadline - now - PACE_SPIN_NS;
+        struct timespec ts = { (time_t)(wait / 1000000000ull), (long)(wait % 1000000000ull) };
+        nanosleep(&ts, NULL);
+    }
+    while (NANO() < deadline) sched_yield();
+}
+
+static inline void limiter_init(FrameLimiter *fl, PaceMode mode, int fps)
+{
+    fl->mode = (mode == PACE_CAPPED && fps <= 0) ? PACE_UNCAPPED : mode;
+    fl->interval = (fps > 0) ? 1000000000ull / (uint64_t)fps : 0;
+    fl->next = NANO();
+}
+
+// Waits for the start of the next frame. Deadlines advance by a fixed
+// interval so rounding doesn't drift; after a long stall they restart from now
+// instead of rushing out a burst of frames.
+static inline void limiter_wait(FrameLimiter *fl)
+{
+    if (fl->mode != PACE_CAPPED) return;
+    uint64_t now = NANO();
+    fl->next += fl->interval;
+    if (fl->next + fl->interval < now) fl->next = now;
+    sleep_until(fl->next);
+}
+
+// Simulation runs in steps of DELTA_TIME whatever the frame rate; rendering
+// interpolates between the last two steps by alpha
+typedef struct
+{
+    uint64_t last;
+    uint64_t accumulator;
+    float alpha;
+}
+FixedStep;
+
+static inline void fixed_step_init(FixedStep *fs)
+{
+    fs->last = NANO();
+    fs->accumulator = 0;
+    fs->alpha = 0.0f;
+}
+
+// Returns how many steps to run this frame and updates alpha for the rest
+static inline int fixed_step_advance(FixedStep *fs)
+{
+    const uint64_t step = (uint64_t)DELTA_TIME;
+    uint64_t now = NANO();
+    uint64_t elapsed = now - fs->last;
+    fs->last = now;
+    if (elapsed > PACE_MAX_CATCHUP_NS) elapsed = PACE_MAX_CATCHUP_NS;
+
+    fs->accumulator += elapsed;
+    int steps = (int)(fs->accumulator / step);
+    fs->accumulator -= (uint64_t)steps * step;
+    fs->alpha = (float)fs->accumulator / (float)step;
+    return steps;
+}
+
+static inline Camera camera_lerp(Camera a, Camera b, float t)
+{
+    Camera c = b;
+    c.pos_x = lerp(a.pos_x, b.pos_x, t);
+    c.pos_y = lerp(a.pos_y, b.pos_y, t);
+    c.pos_z = lerp(a.pos_z, b.pos_z, t);
+    c.angle_x = lerp(a.angle_x, b.angle_x, t);
+    c.angle_y = lerp(a.angle_y, b.angle_y, t);
+    return c;
+}
+
+#endif // PACING_H
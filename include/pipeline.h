@@ -0,0 +1,226 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "game.h"
+#include "present.h"
+
+// Framebuffers rotated between the render thread and the present/event
+// thread (main). Only main talks to X; the render thread never does.
+//
+//   FREE -> RENDERING -> READY -> PRESENTING -> FREE
+//
+// A newer READY frame replaces an older one that was never shown, so the
+// screen always gets the most recent frame and rendering never waits on a
+// slow present as long as a spare slot exists.
+#define PIPELINE_MAX_SLOTS 3
+
+typedef enum
+{
+    SLOT_FREE,
+    SLOT_RENDERING,
+    SLOT_READY,
+    SLOT_PRESENTING
+}
+SlotState;
+
+typedef struct
+{
+    buffer buf;
+    PresentImage image;
+    SlotState state;
+    uint64_t frame;
+}
+FrameSlot;
+
+typedef struct
+{
+    FrameSlot slots[PIPELINE_MAX_SLOTS];
+    int slot_count;
+    float *depth_buffer;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    uint64_t frame;
+    int input;
+    int paused;
+    int quit;
+
+    // Vsync-like pacing: no new frame starts until the last one is on screen
+    int fifo;
+
+    // Held while the level, camera, keys and editor state are read or changed
+    pthread_mutex_t scene;
+
+    // The render thread writes a byte here per finished frame so main can
+    // poll it next to the X connection
+    int wake[2];
+}
+Pipeline;
+
+static inline void pipeline_init(Pipeline *pl, int slot_count)
+{
+    *pl = (Pipeline){0};
+    if (slot_count < 2) slot_count = 2;
+    if (slot_count > PIPELINE_MAX_SLOTS) slot_count = PIPELINE_MAX_SLOTS;
+    pl->slot_count = slot_count;
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->cv, NULL);
+    pthread_mutex_init(&pl->scene, NULL);
+    if (pipe(pl->wake) == 0)
+    {
+        fcntl(pl->wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(pl->wake[1], F_SETFL, O_NONBLOCK);
+    }
+}
+
+// (Re)creates every slot's image at w x h; the render thread must be paused
+static inline void pipeline_attach(Pipeline *pl, Presenter *p, int w, int h)
+{
+    free(pl->depth_buffer);
+    pl->depth_buffer = (float *)malloc(sizeof(float) * w * h);
+    for (int i = 0; i < pl->slot_count; i++)
+    {
+        FrameSlot *s = &pl->slots[i];
+        s->buf = (buffer){0};
+        s->buf.w = w;
+        s->buf.h = h;
+        s->buf.depth_buffer = pl->depth_buffer;
+        present_attach(p, &s->image, &s->buf);
+        s->state = SLOT_FREE;
+    }
+}
+
+static inline void pipeline_detach(Pipeline *pl, Presenter *p)
+{
+    for (int i = 0; i < pl->slot_count; i++)
+        present_detach(p, &pl->slots[i].image, &pl->slots[i].buf);
+    free(pl->depth_buffer);
+    pl->depth_buffer = NULL;
+}
+
+static inline void pipeline_free(Pipeline *pl)
+{
+    pthread_mutex_destroy(&pl->lock);
+    pthread_cond_destroy(&pl->cv);
+    pthread_mutex_destroy(&pl->scene);
+    close(pl->wake[0]);
+    close(pl->wake[1]);
+}
+
+// Render thread: waits for a free slot, for main to finish handling input
+// and for any resize to end. Returns -1 once the pipeline shuts down.
+static inline int pipeline_acquire(Pipeline *pl)
+{
+    pthread_mutex_lock(&pl->lock);
+    for (;;)
+    {
+        if (pl->quit) break;
+        int in_flight = 0;
+        if (pl->fifo)
+        {
+            for (int i = 0; i < pl->slot_count; i++)
+                if (pl->slots[i].state == SLOT_READY || pl->slots[i].state == SLOT_PRESENTING) in_flight = 1;
+        }
+        if (!pl->input && !pl->paused && !in_flight)
+        {
+            for (int i = 0; i < pl->slot_count; i++)
+            {
+                if (pl->slots[i].state != SLOT_FREE) continue;
+                pl->slots[i].state = SLOT_RENDERING;
+                pthread_mutex_unlock(&pl->lock);
+                return i;
+            }
+        }
+        pthread_cond_wait(&pl->cv, &pl->lock);
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return -1;
+}
+
+static inline void pipeline_submit(Pipeline *pl, int index)
+{
+    pthread_mutex_lock(&pl->lock);
+    for (int i = 0; i < pl->slot_count; i++)
+        if (pl->slots[i].state == SLOT_READY) pl->slots[i].state = SLOT_FREE;
+    pl->slots[index].state = SLOT_READY;
+    pl->slots[index].frame = ++pl->frame;
+    pthread_cond_broadcast(&pl->cv);
+    pthread_mutex_unlock(&pl->lock);
+
+    char byte = 1;
+    ssize_t written = write(pl->wake[1], &byte, 1);
+    (void)written;
+}
+
+// Main: the ready frame to put on screen, or -1
+static inline int pipeline_take(Pipeline *pl)
+{
+    char drain[64];
+    while (read(pl->wake[0], drain, sizeof(drain)) > 0) {}
+
+    int index = -1;
+    pthread_mutex_lock(&pl->lock);
+    for (int i = 0; i < pl->slot_count; i++)
+    {
+        if (pl->slots[i].state != SLOT_READY) continue;
+        pl->slots[i].state = SLOT_PRESENTING;
+        index = i;
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return index;
+}
+
+static inline void pipeline_release(Pipeline *pl, int index)
+{
+    pthread_mutex_lock(&pl->lock);
+    pl->slots[index].state = SLOT_FREE;
+    pthread_cond_broadcast(&pl->cv);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+// Main: while input is pending the render thread does not start a new frame,
+// so events are applied before the next frame samples them
+static inline void pipeline_set_input(Pipeline *pl, int input)
+{
+    pthread_mutex_lock(&pl->lock);
+    pl->input = input;
+    if (!input) pthread_cond_broadcast(&pl->cv);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+// Main: stops the render thread between frames, e.g. to resize the slots
+static inline void pipeline_pause(Pipeline *pl)
+{
+    pthread_mutex_lock(&pl->lock);
+    pl->paused = 1;
+    for (;;)
+    {
+        int rendering = 0;
+        for (int i = 0; i < pl->slot_count; i++)
+            if (pl->slots[i].state == SLOT_RENDERING) rendering = 1;
+        if (!rendering) break;
+        pthread_cond_wait(&pl->cv, &pl->lock);
+    }
+    pthread_mutex_unlock(&pl->lock);
+}
+
+static inline void pipeline_resume(Pipeline *pl)
+{
+    pthread_mutex_lock(&pl->lock);
+    pl->paused = 0;
+    pthread_cond_broadcast(&pl->cv);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+static inline void pipeline_quit(Pipeline *pl)
+{
+    pthread_mutex_lock(&pl->lock);
+    pl->quit = 1;
+    pthread_cond_broadcast(&pl->cv);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+#endif // PIPELINE_H
@@ -0,0 +1,187 @@
+#ifndef PRESENT_H
+#define PRESENT_H
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include "game.h"
+
+// Puts framebuffers on screen. With MIT-SHM each color buffer lives in a
+// shared memory segment the server reads directly; otherwise (remote display,
+// extension missing, --no-shm) it falls back to XPutImage through the socket.
+typedef struct
+{
+    Display *disp;
+    Window win;
+    GC gc;
+    XVisualInfo vis;
+    int use_shm; // new images try MIT-SHM; cleared after the first failure
+    int completion_type;
+}
+Presenter;
+
+// One presentable image; owns the color memory of the buffer attached to it
+typedef struct
+{
+    XImage *img;
+    XShmSegmentInfo shm;
+    int use_shm; // how this image was created, for presenting and teardown
+    int pending;
+}
+PresentImage;
+
+static int g_present_shm_failed = 0;
+
+static int present_shm_error(Display *disp, XErrorEvent *ev)
+{
+    (void)disp;
+    (void)ev;
+    g_present_shm_failed = 1;
+    return 0;
+}
+
+static inline void present_init(Presenter *p, Display *disp, Window win, GC gc, XVisualInfo vis, int allow_shm)
+{
+    *p = (Presenter){0};
+    p->disp = disp;
+    p->win = win;
+    p->gc = gc;
+    p->vis = vis;
+    p->use_shm = allow_shm && XShmQueryExtension(disp);
+    if (p->use_shm) p->completion_type = XShmGetEventBase(disp) + ShmCompletion;
+}
+
+static inline int present_attach_shm(Presenter *p, PresentImage *pi, buffer *buf)
+{
+    pi->img = XShmCreateImage(p->disp, p->vis.visual, p->vis.depth, ZPixmap, NULL, &pi->shm, buf->w, buf->h);
+    if (!pi->img) return 0;
+
+    pi->shm.shmid = shmget(IPC_PRIVATE, (size_t)pi->img->bytes_per_line * pi->img->height, IPC_CREAT | 0600);
+    if (pi->shm.shmid < 0)
+    {
+        XDestroyImage(pi->img);
+        pi->img = NULL;
+        return 0;
+    }
+    pi->shm.shmaddr = pi->img->data = (char *)shmat(pi->shm.shmid, NULL, 0);
+    pi->shm.readOnly = False;
+    if (pi->shm.shmaddr == (char *)-1)
+    {
+        shmctl(pi->shm.shmid, IPC_RMID, NULL);
+        pi->img->data = NULL;
+        XDestroyImage(pi->img);
+        pi->img = NULL;
+        return 0;
+    }
+
+    // Attaching fails asynchronously on remote displays, so sync and check
+    g_present_shm_failed = 0;
+    int (*old_handler)(Display *, XErrorEvent *) = XSetErrorHandler(present_shm_error);
+    XShmAttach(p->disp, &pi->shm);
+    XSync(p->disp, False);
+    XSetErrorHandler(old_handler);
+
+    // The segment is freed once both sides detach
+    shmctl(pi->shm.shmid, IPC_RMID, NULL);
+
+    if (g_present_shm_failed)
+    {
+        shmdt(pi->shm.shmaddr);
+        pi->img->data = NULL;
+        XDestroyImage(pi->img);
+        pi->img = NULL;
+        return 0;
+    }
+
+    buf->pitch = pi->img->bytes_per_line;
+    buf->size = (uint64_t)buf->pitch * buf->h;
+    buf->mem = (uint8_t *)pi->img->data;
+    return 1;
+}
+
+// Creates an image for the buffer's current size and points buf->mem at it
+static inline void present_attach(Presenter *p, PresentImage *pi, buffer *buf)
+{
+    *pi = (PresentImage){0};
+    pi->use_shm = p->use_shm && present_attach_shm(p, pi, buf);
+    if (pi->use_shm) return;
+    if (p->use_shm)
+    {
+        printf("[LOG] MIT-SHM unavailable, presenting with XPutImage\n");
+        p->use_shm = 0;
+    }
+
+    buf->pitch = buf->w * 4;
+    buf->size = (uint64_t)buf->pitch * buf->h;
+    buf->mem = (uint8_t *)malloc(buf->size);
+    pi->img = XCreateImage(p->disp, p->vis.visual, p->vis.depth,
+        ZPixmap, 0, (char *)buf->mem, buf->w, buf->h, 32, 0);
+}
+
+// Segment whose put has finished if ev is a completion event, 0 otherwise
+static inline ShmSeg present_completed(const Presenter *p, const XEvent *ev)
+{
+    if (!p->completion_type || ev->type != p->completion_type) return 0;
+    return ((const XShmCompletionEvent *)ev)->shmseg;
+}
+
+typedef struct
+{
+    int type;
+    ShmSeg seg;
+}
+PresentMatch;
+
+static Bool present_is_completion(Display *disp, XEvent *ev, XPointer arg)
+{
+    (void)disp;
+    const PresentMatch *m = (const PresentMatch *)arg;
+    return ev->type == m->type && ((XShmCompletionEvent *)ev)->shmseg == m->seg;
+}
+
+// Blocks until the server has finished reading the image, so its buffer can
+// be drawn into again. Other events stay queued for the main loop.
+static inline void present_wait(Presenter *p, PresentImage *pi)
+{
+    if (!pi->pending) return;
+    PresentMatch match = { p->completion_type, pi->shm.shmseg };
+    XEvent ev;
+    XIfEvent(p->disp, &ev, present_is_completion, (XPointer)&match);
+    pi->pending = 0;
+}
+
+static inline void present_detach(Presenter *p, PresentImage *pi, buffer *buf)
+{
+    if (!pi->img) return;
+    present_wait(p, pi);
+    if (pi->use_shm)
+    {
+        XShmDetach(p->disp, &pi->shm);
+        XSync(p->disp, False);
+        shmdt(pi->shm.shmaddr);
+        pi->img->data = NULL;
+    }
+    // Frees buf->mem along with the image in the XPutImage path
+    XDestroyImage(pi->img);
+    pi->img = NULL;
+    buf->mem = NULL;
+}
+
+// Returns 1 while the server still reads the image after the call; the
+// matching completion then shows up through present_completed
+static inline int present_frame(Presenter *p, PresentImage *pi, int w, int h)
+{
+    if (pi->use_shm)
+    {
+        XShmPutImage(p->disp, p->win, p->gc, pi->img, 0, 0, 0, 0, w, h, True);
+        XFlush(p->disp);
+        pi->pending = 1;
+        return 1;
+    }
+    XPutImage(p->disp, p->win, p->gc, pi->img, 0, 0, 0, 0, w, h);
+    return 0;
+}
+
+#endif // PRESENT_H
@@ -0,0 +1,261 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "game.h"
+
+// Per-stage frame timers on NANO(). The last PROFILE_FRAMES frames are kept
+// in a ring for the HUD; with a trace file open every frame is also streamed
+// out as Chrome trace events (chrome://tracing, ui.perfetto.dev).
+#define PROFILE_FRAMES 256
+#define PROFILE_MAX_EVENTS 32
+#define PROFILE_HUD_AVERAGE 30
+
+typedef enum
+{
+    PROFILE_EVENTS,
+    PROFILE_SHADOW,
+    PROFILE_BAKE,
+    PROFILE_FLOOR,
+    PROFILE_LEVEL,
+    PROFILE_RASTER,
+    PROFILE_UPSCALE,
+    PROFILE_EDITOR,
+    PROFILE_HUD,
+    PROFILE_PRESENT,
+    PROFILE_PACING,
+    PROFILE_STAGE_COUNT
+}
+ProfileStage;
+
+static const char *g_profile_stage_names[PROFILE_STAGE_COUNT] = {
+    "events", "shadow", "bake", "floor", "level", "raster", "upscale", "editor", "hud", "present", "pacing"
+};
+
+typedef struct
+{
+    int stage;
+    uint64_t begin;
+    uint64_t end;
+}
+ProfileEvent;
+
+typedef struct
+{
+    uint64_t begin;
+    uint64_t end;
+    uint64_t stage_time[PROFILE_STAGE_COUNT];
+    ProfileEvent events[PROFILE_MAX_EVENTS];
+    int event_count;
+    FrameStats stats;
+}
+ProfileFrame;
+
+typedef struct
+{
+    ProfileFrame frames[PROFILE_FRAMES];
+    int frame_count;
+    int in_frame;
+    int hud;
+
+    // Time spent on other threads, folded into the next frame that ends
+    uint64_t external[PROFILE_STAGE_COUNT];
+
+    FILE *trace;
+    uint64_t trace_begin;
+    int trace_events;
+}
+Profiler;
+
+static Profiler g_profiler;
+
+static inline ProfileFrame *profile_frame(int age)
+{
+    return &g_profiler.frames[(g_profiler.frame_count - age + PROFILE_FRAMES) % PROFILE_FRAMES];
+}
+
+static inline void profile_frame_begin(void)
+{
+    ProfileFrame *f = profile_frame(0);
+    memset(f, 0, sizeof(*f));
+    f->begin = NANO();
+    g_profiler.in_frame = 1;
+}
+
+// Timers outside profile_frame_begin/end are ignored, so callers like the
+// headless renderer need no special casing
+static inline int profile_begin(int stage)
+{
+    if (!g_profiler.in_frame) return -1;
+    ProfileFrame *f = profile_frame(0);
+    if (f->event_count >= PROFILE_MAX_EVENTS) return -1;
+
+    int index = f->event_count++;
+    f->events[index].stage = stage;
+    f->events[index].begin = NANO();
+    return index;
+}
+
+static inline void profile_end(int index)
+{
+    if (index < 0 || !g_profiler.in_frame) return;
+    ProfileFrame *f = profile_frame(0);
+    ProfileEvent *e = &f->events[index];
+    e->end = NANO();
+    f->stage_time[e->stage] += e->end - e->begin;
+}
+
+// Frames and scoped timers belong to the rendering thread; other threads
+// report their stage time through here instead
+static inline void profile_add(int stage, uint64_t ns)
+{
+    __atomic_fetch_add(&g_profiler.external[stage], ns, __ATOMIC_RELAXED);
+}
+
+// PROFILE_SCOPE(stage) times the rest of the enclosing block
+typedef struct
+{
+    int index;
+}
+ProfileScope;
+
+static inline void profile_scope_end(ProfileScope *scope)
+{
+    profile_end(scope->index);
+}
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(stage) \
+    ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__) \
+    __attribute__((cleanup(profile_scope_end))) = { profile_begin(stage) }
+
+static inline void profile_trace_write(const ProfileFrame *f)
+{
+    FILE *out = g_profiler.trace;
+    double base = (double)g_profiler.trace_begin;
+
+    fprintf(out, "%s{\"name\":\"frame\",\"cat\":\"frame\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1}",
+        g_profiler.trace_events++ ? ",\n" : "\n",
+        (f->begin - base) / 1e3, (f->end - f->begin) / 1e3);
+    for (int i = 0; i < f->event_count; i++)
+    {
+        const ProfileEvent *e = &f->events[i];
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1}",
+            g_profile_stage_names[e->stage], (e->begin - base) / 1e3, (e->end - e->begin) / 1e3);
+    }
+    fprintf(out, ",\n{\"name\":\"counters\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"args\":"
+        "{\"tris_submitted\":%d,\"tris_rasterized\":%d,\"pixels_shaded\":%d,\"walls_culled\":%d,\"blocks_culled\":%d}}",
+        (f->begin - base) / 1e3, f->stats.tris_submitted, f->stats.tris_rasterized,
+        f->stats.pixels_shaded, f->stats.objects_culled, f->stats.blocks_culled);
+}
+
+static inline void profile_frame_end(const FrameStats *stats)
+{
+    if (!g_profiler.in_frame) return;
+    ProfileFrame *f = profile_frame(0);
+    f->end = NANO();
+    if (stats) f->stats = *stats;
+    for (int s = 0; s < PROFILE_STAGE_COUNT; s++)
+        f->stage_time[s] += __atomic_exchange_n(&g_profiler.external[s], 0, __ATOMIC_RELAXED);
+    if (g_profiler.trace) profile_trace_write(f);
+
+    g_profiler.frame_count++;
+    g_profiler.in_frame = 0;
+}
+
+static inline int profile_trace_open(const char *filename)
+{
+    g_profiler.trace = fopen(filename, "w");
+    if (!g_profiler.trace)
+    {
+        printf("[ERROR] Couldn't open trace file %s\n", filename);
+        return 0;
+    }
+    fprintf(g_profiler.trace, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    g_profiler.trace_begin = NANO();
+    g_profiler.trace_events = 0;
+    return 1;
+}
+
+static inline void profile_trace_close(void)
+{
+    if (!g_profiler.trace) return;
+    fprintf(g_profiler.trace, "\n]}\n");
+    fclose(g_profiler.trace);
+    g_profiler.trace = NULL;
+    printf("[LOG] Wrote %d frames to trace\n", g_profiler.trace_events);
+}
+
+// Stage timings averaged over the last completed frames, counters of the
+// frame being drawn and a graph of recent frame times. The font has no
+// punctuation beyond ",.-", hence the bare labels.
+static inline void profile_draw_hud(Olivec_Canvas oc, const FrameStats *stats, int wall_count)
+{
+    if (!g_profiler.hud) return;
+
+    int frames = g_profiler.frame_count < PROFILE_HUD_AVERAGE ? g_profiler.frame_count : PROFILE_HUD_AVERAGE;
+    double stage_ms[PROFILE_STAGE_COUNT] = {0};
+    double frame_ms = 0.0;
+    for (int i = 1; i <= frames; i++)
+    {
+        const ProfileFrame *f = profile_frame(i);
+        frame_ms += (f->end - f->begin) / 1e6;
+        for (int s = 0; s < PROFILE_STAGE_COUNT; s++)
+            stage_ms[s] += f->stage_time[s] / 1e6;
+    }
+    if (frames > 0)
+    {
+        frame_ms /= frames;
+        for (int s = 0; s < PROFILE_STAGE_COUNT; s++) stage_ms[s] /= frames;
+    }
+
+    const int size = 2;
+    const int line = (OLIVEC_DEFAULT_FONT_HEIGHT + 2) * size;
+    const int graph_w = PROFILE_FRAMES;
+    const int graph_h = 60;
+    int x = 10, y = 10;
+    int lines = 6 + PROFILE_STAGE_COUNT;
+    olivec_rect(oc, x - 5, y - 5, graph_w + 10, lines * line + graph_h + 15, 0xA0000000);
+
+    char text[64];
+    snprintf(text, sizeof(text), "fps %.1f  %.2f ms", frame_ms > 0.0 ? 1000.0 / frame_ms : 0.0, frame_ms);
+    olivec_text(oc, text, x, y, olivec_default_font, size, 0xFFFFFFFF);
+    y += line;
+
+    for (int s = 0; s < PROFILE_STAGE_COUNT; s++)
+    {
+        snprintf(text, sizeof(text), "%-10s %6.2f", g_profile_stage_names[s], stage_ms[s]);
+        olivec_text(oc, text, x, y, olivec_default_font, size, 0xFFCCCCCC);
+        y += line;
+    }
+
+    snprintf(text, sizeof(text), "tris %d of %d", stats->tris_rasterized, stats->tris_submitted);
+    olivec_text(oc, text, x, y, olivec_default_font, size, 0xFFFFFFFF);
+    y += line;
+    snprintf(text, sizeof(text), "pixels %d  blocks culled %d", stats->pixels_shaded, stats->blocks_culled);
+    olivec_text(oc, text, x, y, olivec_default_font, size, 0xFFFFFFFF);
+    y += line;
+    snprintf(text, sizeof(text), "walls %d of %d", wall_count - stats->objects_culled, wall_count);
+    olivec_text(oc, text, x, y, olivec_default_font, size, 0xFFFFFFFF);
+    y += line;
+    snprintf(text, sizeof(text), "render %dx%d of %dx%d", stats->render_w, stats->render_h, (int)oc.width, (int)oc.height);
+    olivec_text(oc, text, x, y, olivec_default_font, size, 0xFFFFFFFF);
+    y += line + 5;
+
+    // One bar per frame, newest on the right; full height is 33.3 ms and the
+    // line marks 16.7 ms
+    int bottom = y + graph_h;
+    int count = g_profiler.frame_count < PROFILE_FRAMES ? g_profiler.frame_count : PROFILE_FRAMES - 1;
+    for (int i = 1; i <= count; i++)
+    {
+        const ProfileFrame *f = profile_frame(i);
+        float ms = (f->end - f->begin) / 1e6f;
+        int h = (int)(ms / 33.3f * graph_h);
+        if (h > graph_h) h = graph_h;
+        uint32_t c = ms < 16.7f ? 0xFF4ADE80 : (ms < 33.3f ? 0xFFEAD14B : 0xFFCC4A4A);
+        olivec_line(oc, x + graph_w - i, bottom, x + graph_w - i, bottom - h, c);
+    }
+    olivec_line(oc, x, bottom - graph_h / 2, x + graph_w, bottom - graph_h / 2, 0x80FFFFFF);
+}
+
+#endif // PROFILE_H
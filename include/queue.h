@@ -0,0 +1,117 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include "game.h"
+
+// Per-frame list of screen-space triangles, sorted by depth before they are
+// set up and binned. Opaque geometry goes front to back so the depth test and
+// the hierarchical Z reject hidden triangles early; back to front is there
+// for blended geometry.
+typedef enum
+{
+    RENDER_FRONT_TO_BACK,
+    RENDER_BACK_TO_FRONT,
+    RENDER_UNSORTED
+}
+RenderOrder;
+
+typedef struct
+{
+    RenderTri *tris;
+    int count;
+    int capacity;
+
+    // Sort scratch: depth key in the high half, triangle index in the low
+    uint64_t *items;
+    uint64_t *scratch;
+    int item_capacity;
+}
+RenderQueue;
+
+static inline void render_queue_free(RenderQueue *q)
+{
+    free(q->tris);
+    free(q->items);
+    free(q->scratch);
+    *q = (RenderQueue){0};
+}
+
+// Per-vertex colors and fog table coordinates; flat triangles repeat theirs.
+// The triangle is untextured until the caller says otherwise.
+static inline RenderTri *render_queue_push(RenderQueue *q, const Vec3 screen[3], const uint32_t color[3], const float fog[3])
+{
+    if (q->count >= q->capacity)
+    {
+        q->capacity = q->capacity ? q->capacity * 2 : MAX_TRIANGLES;
+        q->tris = (RenderTri *)realloc(q->tris, sizeof(RenderTri) * q->capacity);
+    }
+    RenderTri *t = &q->tris[q->count++];
+    for (int i = 0; i < 3; i++)
+    {
+        t->tri[i] = screen[i];
+        t->color[i] = color[i];
+        t->fog[i] = fog[i];
+    }
+    t->texture = NULL;
+
+    // Nearest vertex: what the depth test meets first
+    t->depth = fminf(screen[0].z, fminf(screen[1].z, screen[2].z));
+    return t;
+}
+
+// Float bits reordered so unsigned comparison matches float comparison
+static inline uint32_t render_depth_key(float depth)
+{
+    uint32_t bits;
+    memcpy(&bits, &depth, sizeof(bits));
+    return (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+}
+
+// Returns the triangle indices in draw order: a stable LSD radix sort on the
+// 32-bit depth key, one byte per pass, skipping passes where every key has
+// the same byte
+static inline const uint64_t *render_queue_sort(RenderQueue *q, RenderOrder order)
+{
+    int n = q->count;
+    if (n > q->item_capacity)
+    {
+        q->item_capacity = q->capacity;
+        q->items = (uint64_t *)realloc(q->items, sizeof(uint64_t) * q->item_capacity);
+        q->scratch = (uint64_t *)realloc(q->scratch, sizeof(uint64_t) * q->item_capacity);
+    }
+
+    uint32_t flip = (order == RENDER_BACK_TO_FRONT) ? 0xFFFFFFFFu : 0u;
+    for (int i = 0; i < n; i++)
+    {
+        uint32_t key = (order == RENDER_UNSORTED) ? 0u : render_depth_key(q->tris[i].depth) ^ flip;
+        q->items[i] = ((uint64_t)key << 32) | (uint32_t)i;
+    }
+    if (n < 2 || order == RENDER_UNSORTED) return q->items;
+
+    uint64_t *src = q->items;
+    uint64_t *dst = q->scratch;
+    for (int shift = 32; shift < 64; shift += 8)
+    {
+        int counts[256] = {0};
+        for (int i = 0; i < n; i++)
+            counts[(src[i] >> shift) & 0xFF]++;
+        if (counts[(src[0] >> shift) & 0xFF] == n) continue;
+
+        int offset = 0;
+        for (int b = 0; b < 256; b++)
+        {
+            int c = counts[b];
+            counts[b] = offset;
+            offset += c;
+        }
+        for (int i = 0; i < n; i++)
+            dst[counts[(src[i] >> shift) & 0xFF]++] = src[i];
+
+        uint64_t *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    return src;
+}
+
+#endif // QUEUE_H
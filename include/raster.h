@@ -0,0 +1,719 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <pthread.h>
+#include <unistd.h>
+#include "game.h"
+#include "util.h"
+#include "span.h"
+#include "ground.h"
+#include "queue.h"
+
+#define RASTER_TILE_W 64
+#define RASTER_TILE_H 64
+#define RASTER_MAX_WORKERS 32
+
+// Keeps snapped coordinates and edge products well inside int64
+#define RASTER_MAX_COORD 4194304.0f
+
+// Depth is only reset once per epoch. Frame k of an epoch stores depth d,
+// clamped to [0, 1], as (1 + g + d * (1 - 2g)) / 2^(k + 1): every frame gets
+// a float binade of its own below the ones earlier frames used, so whatever
+// they left behind is already farther than anything drawn now. Scaling by a
+// power of two is exact, so each frame rounds and compares its depths just
+// like the first, and the guard g keeps interpolation inside the binade.
+#define RASTER_DEPTH_EPOCH 8
+#define RASTER_DEPTH_GUARD (1.0f / 256.0f)
+
+// Hierarchical Z: each tile keeps an upper bound on the depth of its 8x8
+// blocks. A triangle skips every block where its nearest possible depth is
+// already behind that, and runs of visible blocks go to the span kernel
+// together. Nothing stored this epoch is farther than 1, and depth only ever
+// decreases, so bounds start at 1 without reading the buffer and are
+// tightened whenever a triangle covers a block completely. The slack covers
+// float error between the plane bounds and the spans' stepping, and shrinks
+// with the frame's binade.
+#define RASTER_HIZ_BLOCK 8
+#define RASTER_HIZ_PER_TILE ((RASTER_TILE_W / RASTER_HIZ_BLOCK) * (RASTER_TILE_H / RASTER_HIZ_BLOCK))
+#define RASTER_HIZ_SLACK 1e-4f
+
+// Screen-space triangle after setup, shared read-only by all tiles it touches.
+// Edge i evaluates to edge_a[i]*x + edge_b[i]*y + edge_c[i] at pixel (x, y),
+// with the top-left bias folded into edge_c so coverage is a sign test.
+typedef struct
+{
+    int64_t edge_a[3];
+    int64_t edge_b[3];
+    int64_t edge_c[3];
+    float z_c;
+    float z_dx;
+    float z_dy;
+    float z_min;
+    uint32_t color;
+
+    // Red, green, blue and fog coordinate planes for the shaded modes
+    float shade_c[4];
+    float shade_dx[4];
+    float shade_dy[4];
+    int32_t shade_step[4];
+    int32_t shade_step_y[4];
+
+    // Textured triangles: 1/w, u/w and v/w planes, u and v in repeats
+    const Texture *texture;
+    float tex_c[3];
+    float tex_dx[3];
+    float tex_dy[3];
+
+    int wide;
+    int min_x, min_y;
+    int max_x, max_y;
+}
+RasterTri;
+
+typedef struct
+{
+    int *items;
+    int count;
+    int capacity;
+}
+RasterBin;
+
+typedef struct
+{
+    buffer *target;
+    const SpanKernel *kernels;
+    ShadeMode shade;
+    int depth_test;
+
+    // SPAN_* bits of the kernel every triangle of this flush is drawn with
+    int features;
+    Ground ground;
+    FrameStats stats;
+    int clear;
+    uint32_t clear_color;
+
+    // Triangles are queued as submitted and set up in this order at flush
+    RenderQueue queue;
+    RenderOrder order;
+
+    // Depth epoch state and the buffer it belongs to
+    int clear_depth;
+    int depth_frame;
+    float depth_scale;
+    float depth_offset;
+    float depth_slack;
+    float *depth_buffer;
+    uint32_t depth_size;
+
+    RasterTri *tris;
+    int tri_count;
+    int tri_capacity;
+
+    RasterBin *bins;
+    int tiles_x;
+    int tiles_y;
+    int tile_count;
+    int bin_capacity;
+
+    pthread_t workers[RASTER_MAX_WORKERS];
+    int worker_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv;
+    pthread_cond_t done_cv;
+    int generation;
+    int busy;
+    int next_tile;
+    int quit;
+}
+Raster;
+
+// Nearest depth the triangle can have over pixels [x0, x1] x [y0, y1]: the
+// plane's minimum over the rect, but never nearer than its nearest vertex
+static inline float raster_tri_near(const RasterTri *t, float slack, int x0, int y0, int x1, int y1)
+{
+    float x = t->z_dx > 0.0f ? (float)x0 : (float)x1;
+    float y = t->z_dy > 0.0f ? (float)y0 : (float)y1;
+    float z = t->z_c + t->z_dx * x + t->z_dy * y;
+    return (z > t->z_min ? z : t->z_min) - slack;
+}
+
+// After drawing a triangle that covers the whole block, nothing in the block
+// is farther than the triangle's own farthest depth there
+static inline void raster_hiz_cover(const RasterTri *t, float slack, float *hiz, int block, int x0, int y0, int x1, int y1)
+{
+    for (int e = 0; e < 3; e++)
+    {
+        int64_t w = t->edge_a[e] * x0 + t->edge_b[e] * y0 + t->edge_c[e];
+        int64_t dx = t->edge_a[e] * (x1 - x0);
+        int64_t dy = t->edge_b[e] * (y1 - y0);
+        if (w < 0 || w + dx < 0 || w + dy < 0 || w + dx + dy < 0) return;
+    }
+    float x = t->z_dx > 0.0f ? (float)x1 : (float)x0;
+    float y = t->z_dy > 0.0f ? (float)y1 : (float)y0;
+    float z = t->z_c + t->z_dx * x + t->z_dy * y + slack;
+    if (z < hiz[block]) hiz[block] = z;
+}
+
+static inline int32_t raster_fixed(float v)
+{
+    v *= 65536.0f;
+    if (v > 1073741824.0f) v = 1073741824.0f;
+    if (v < -1073741824.0f) v = -1073741824.0f;
+    return (int32_t)v;
+}
+
+static inline void raster_shade_at(const RasterTri *t, int x, int y, SpanShade *s)
+{
+    for (int k = 0; k < 4; k++)
+    {
+        s->v[k] = raster_fixed(t->shade_c[k] + t->shade_dx[k] * x + t->shade_dy[k] * y);
+        s->dx[k] = t->shade_step[k];
+    }
+}
+
+// Picks the mip level for the pixel footprint at the middle of [x0, x1] x
+// [y0, y1], from the derivatives of u = (u/w) / (1/w) and v likewise, and
+// sets the span's texture steps in that level's texels from (x0, y0)
+static inline void raster_texture_at(const RasterTri *t, int x0, int y0, int x1, int y1, SpanShade *s, float tq_dy[3])
+{
+    const Texture *tex = t->texture;
+    float cx = 0.5f * (x0 + x1), cy = 0.5f * (y0 + y1);
+    float q = t->tex_c[0] + t->tex_dx[0] * cx + t->tex_dy[0] * cy;
+    int lod = 0;
+    if (q > 1e-9f)
+    {
+        float inv = 1.0f / q;
+        float u = (t->tex_c[1] + t->tex_dx[1] * cx + t->tex_dy[1] * cy) * inv;
+        float v = (t->tex_c[2] + t->tex_dx[2] * cx + t->tex_dy[2] * cy) * inv;
+        float w = (float)(1 << tex->w_log2), h = (float)(1 << tex->h_log2);
+        float ux = (t->tex_dx[1] - u * t->tex_dx[0]) * inv * w, vx = (t->tex_dx[2] - v * t->tex_dx[0]) * inv * h;
+        float uy = (t->tex_dy[1] - u * t->tex_dy[0]) * inv * w, vy = (t->tex_dy[2] - v * t->tex_dy[0]) * inv * h;
+        lod = texture_lod(tex, sqrtf(fmaxf(ux * ux + vx * vx, uy * uy + vy * vy)));
+    }
+
+    int w_log2 = tex->w_log2 - lod, h_log2 = tex->h_log2 - lod;
+    float scale[3] = { 1.0f, (float)(1 << w_log2), (float)(1 << h_log2) };
+    s->texels = tex->texels + tex->offset[lod];
+    s->tex_w_log2 = w_log2;
+    s->tex_w_mask = (1 << w_log2) - 1;
+    s->tex_h_mask = (1 << h_log2) - 1;
+    for (int k = 0; k < 3; k++)
+    {
+        s->tq[k] = (t->tex_c[k] + t->tex_dx[k] * x0 + t->tex_dy[k] * y0) * scale[k];
+        s->tq_dx[k] = t->tex_dx[k] * scale[k];
+        tq_dy[k] = t->tex_dy[k] * scale[k];
+    }
+}
+
+// Returns the number of pixels written to the tile
+static inline int raster_tile(Raster *rs, int tile, int *blocks_culled)
+{
+    RasterBin *bin = &rs->bins[tile];
+    if (bin->count == 0 && !rs->ground.active) return 0;
+
+    buffer *buf = rs->target;
+    int tx = tile % rs->tiles_x;
+    int ty = tile / rs->tiles_x;
+    int tile_x0 = tx * RASTER_TILE_W;
+    int tile_y0 = ty * RASTER_TILE_H;
+    int tile_x1 = (tile_x0 + RASTER_TILE_W < (int)buf->w) ? tile_x0 + RASTER_TILE_W - 1 : (int)buf->w - 1;
+    int tile_y1 = (tile_y0 + RASTER_TILE_H < (int)buf->h) ? tile_y0 + RASTER_TILE_H - 1 : (int)buf->h - 1;
+
+    uint32_t *color = (uint32_t *)buf->mem;
+    float *depth = buf->depth_buffer;
+    int written = 0;
+
+    if (rs->ground.active)
+        written += ground_draw(&rs->ground, buf, tile_x0, tile_y0, tile_x1, tile_y1);
+
+    // Bounds live only as long as the tile is being drawn
+    const int B = RASTER_HIZ_BLOCK;
+    const int blocks_x = RASTER_TILE_W / B;
+    const float slack = rs->depth_slack;
+    float hiz[RASTER_HIZ_PER_TILE];
+    for (int b = 0; b < RASTER_HIZ_PER_TILE; b++) hiz[b] = 1.0f;
+
+    // Without the depth test nothing is hidden and the bounds stay at 1.
+    // Textured triangles always interpolate color, and fog per pixel as it
+    // goes over the texel.
+    const int depth_test = rs->features & SPAN_DEPTH_TEST;
+    const int textured = rs->features | SPAN_TEXTURE | SPAN_SMOOTH | (g_fog_active ? SPAN_FOG : 0);
+
+    // Bins keep setup order, so per-pixel results match a serial draw
+    for (int i = 0; i < bin->count; i++)
+    {
+        const RasterTri *t = &rs->tris[bin->items[i]];
+
+        int minX = (t->min_x > tile_x0) ? t->min_x : tile_x0;
+        int minY = (t->min_y > tile_y0) ? t->min_y : tile_y0;
+        int maxX = (t->max_x < tile_x1) ? t->max_x : tile_x1;
+        int maxY = (t->max_y < tile_y1) ? t->max_y : tile_y1;
+        if (minX > maxX || minY > maxY) continue;
+
+        const int features = t->texture ? textured : rs->features;
+        SpanKernel span = (t->wide ? g_span_scalar : rs->kernels)[features];
+        int bx0 = (minX - tile_x0) / B, bx1 = (maxX - tile_x0) / B;
+        int by0 = (minY - tile_y0) / B, by1 = (maxY - tile_y0) / B;
+
+        for (int by = by0; by <= by1; by++)
+        {
+            int block_y0 = tile_y0 + by * B;
+            int block_y1 = (block_y0 + B - 1 < tile_y1) ? block_y0 + B - 1 : tile_y1;
+            int y0 = (minY > block_y0) ? minY : block_y0;
+            int y1 = (maxY < block_y1) ? maxY : block_y1;
+
+            int bx = bx0;
+            while (bx <= bx1)
+            {
+                // Extend a run over consecutive blocks the triangle may show in
+                int run = bx;
+                while (run <= bx1)
+                {
+                    int block_x0 = tile_x0 + run * B;
+                    int block_x1 = (block_x0 + B - 1 < tile_x1) ? block_x0 + B - 1 : tile_x1;
+                    int x0 = (minX > block_x0) ? minX : block_x0;
+                    int x1 = (maxX < block_x1) ? maxX : block_x1;
+                    if (depth_test && raster_tri_near(t, slack, x0, y0, x1, y1) >= hiz[by * blocks_x + run]) break;
+                    run++;
+                }
+                if (run == bx)
+                {
+                    (*blocks_culled)++;
+                    bx++;
+                    continue;
+                }
+
+                int x0 = (minX > tile_x0 + bx * B) ? minX : tile_x0 + bx * B;
+                int x1 = (maxX < tile_x0 + run * B - 1) ? maxX : tile_x0 + run * B - 1;
+                int64_t w_row[3];
+                for (int e = 0; e < 3; e++)
+                    w_row[e] = t->edge_a[e] * x0 + t->edge_b[e] * y0 + t->edge_c[e];
+                float z_row = t->z_c + t->z_dx * x0 + t->z_dy * y0;
+                int count = x1 - x0 + 1;
+                int idx = y0 * buf->w + x0;
+                int run_written = 0;
+                SpanShade s = { .color = t->color };
+                float tq_dy[3] = { 0.0f, 0.0f, 0.0f };
+                if (features & (SPAN_SMOOTH | SPAN_FOG)) raster_shade_at(t, x0, y0, &s);
+                if (features & SPAN_TEXTURE) raster_texture_at(t, x0, y0, x1, y1, &s, tq_dy);
+
+                for (int y = y0; y <= y1; y++, idx += buf->w)
+                {
+                    run_written += span(color + idx, depth + idx, count, w_row, t->edge_a, z_row, t->z_dx, &s);
+                    if (features & (SPAN_SMOOTH | SPAN_FOG))
+                        for (int k = 0; k < 4; k++) s.v[k] += t->shade_step_y[k];
+                    if (features & SPAN_TEXTURE)
+                        for (int k = 0; k < 3; k++) s.tq[k] += tq_dy[k];
+
+                    w_row[0] += t->edge_b[0];
+                    w_row[1] += t->edge_b[1];
+                    w_row[2] += t->edge_b[2];
+                    z_row += t->z_dy;
+                }
+                written += run_written;
+                if (run_written && depth_test)
+                {
+                    for (int b = bx; b < run; b++)
+                    {
+                        int block_x0 = tile_x0 + b * B;
+                        int block_x1 = (block_x0 + B - 1 < tile_x1) ? block_x0 + B - 1 : tile_x1;
+                        raster_hiz_cover(t, slack, hiz, by * blocks_x + b, block_x0, block_y0, block_x1, block_y1);
+                    }
+                }
+                bx = run;
+            }
+        }
+    }
+    return written;
+}
+
+static inline void raster_run_tiles(Raster *rs)
+{
+    int written = 0;
+    int blocks_culled = 0;
+    for (;;)
+    {
+        int tile = __atomic_fetch_add(&rs->next_tile, 1, __ATOMIC_RELAXED);
+        if (tile >= rs->tile_count) break;
+        written += raster_tile(rs, tile, &blocks_culled);
+    }
+    __atomic_fetch_add(&rs->stats.pixels_shaded, written, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&rs->stats.blocks_culled, blocks_culled, __ATOMIC_RELAXED);
+}
+
+static void *raster_worker(void *arg)
+{
+    Raster *rs = (Raster *)arg;
+    int seen = 0;
+
+    pthread_mutex_lock(&rs->lock);
+    for (;;)
+    {
+        while (!rs->quit && rs->generation == seen)
+            pthread_cond_wait(&rs->work_cv, &rs->lock);
+        if (rs->quit) break;
+        seen = rs->generation;
+        pthread_mutex_unlock(&rs->lock);
+
+        raster_run_tiles(rs);
+
+        pthread_mutex_lock(&rs->lock);
+        if (--rs->busy == 0) pthread_cond_signal(&rs->done_cv);
+    }
+    pthread_mutex_unlock(&rs->lock);
+    return NULL;
+}
+
+static inline void raster_init(Raster *rs)
+{
+    *rs = (Raster){0};
+    rs->kernels = span_select();
+    rs->shade = SHADE_FLAT;
+    rs->depth_test = 1;
+    fog_lut_init();
+    rs->tri_capacity = MAX_TRIANGLES;
+    rs->tris = (RasterTri *)malloc(sizeof(RasterTri) * rs->tri_capacity);
+
+    pthread_mutex_init(&rs->lock, NULL);
+    pthread_cond_init(&rs->work_cv, NULL);
+    pthread_cond_init(&rs->done_cv, NULL);
+
+    // The calling thread rasterizes too, so spawn one worker less than cores
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = (cores > 1) ? (int)cores - 1 : 0;
+    if (count > RASTER_MAX_WORKERS) count = RASTER_MAX_WORKERS;
+    for (int i = 0; i < count; i++)
+    {
+        if (pthread_create(&rs->workers[i], NULL, raster_worker, rs) != 0) break;
+        rs->worker_count++;
+    }
+    printf("[LOG] Rasterizer running on %d threads\n", rs->worker_count + 1);
+}
+
+static inline void raster_free(Raster *rs)
+{
+    pthread_mutex_lock(&rs->lock);
+    rs->quit = 1;
+    pthread_cond_broadcast(&rs->work_cv);
+    pthread_mutex_unlock(&rs->lock);
+    for (int i = 0; i < rs->worker_count; i++)
+        pthread_join(rs->workers[i], NULL);
+
+    for (int i = 0; i < rs->bin_capacity; i++)
+        free(rs->bins[i].items);
+    free(rs->bins);
+    free(rs->tris);
+    render_queue_free(&rs->queue);
+    pthread_mutex_destroy(&rs->lock);
+    pthread_cond_destroy(&rs->work_cv);
+    pthread_cond_destroy(&rs->done_cv);
+}
+
+// Point the binner at a framebuffer; bins follow the buffer size across resizes
+static inline void raster_begin(Raster *rs, buffer *buf)
+{
+    rs->target = buf;
+    rs->tiles_x = (buf->w + RASTER_TILE_W - 1) / RASTER_TILE_W;
+    rs->tiles_y = (buf->h + RASTER_TILE_H - 1) / RASTER_TILE_H;
+    rs->tile_count = rs->tiles_x * rs->tiles_y;
+
+    if (rs->tile_count > rs->bin_capacity)
+    {
+        rs->bins = (RasterBin *)realloc(rs->bins, sizeof(RasterBin) * rs->tile_count);
+        for (int i = rs->bin_capacity; i < rs->tile_count; i++)
+            rs->bins[i] = (RasterBin){0};
+        rs->bin_capacity = rs->tile_count;
+    }
+    for (int i = 0; i < rs->tile_count; i++)
+        rs->bins[i].count = 0;
+    rs->tri_count = 0;
+    rs->queue.count = 0;
+    rs->ground.active = 0;
+    rs->clear = 0;
+    rs->stats = (FrameStats){0};
+
+    // A new or resized depth buffer holds garbage and starts a fresh epoch
+    uint32_t size = buf->w * buf->h;
+    int fresh = buf->depth_buffer != rs->depth_buffer || size != rs->depth_size;
+    rs->depth_buffer = buf->depth_buffer;
+    rs->depth_size = size;
+    rs->depth_frame = fresh ? 0 : rs->depth_frame + 1;
+    if (rs->depth_frame >= RASTER_DEPTH_EPOCH) rs->depth_frame = 0;
+    rs->clear_depth = (rs->depth_frame == 0);
+    float binade = ldexpf(1.0f, -(rs->depth_frame + 1));
+    rs->depth_scale = (1.0f - 2.0f * RASTER_DEPTH_GUARD) * binade;
+    rs->depth_offset = (1.0f + RASTER_DEPTH_GUARD) * binade;
+    rs->depth_slack = RASTER_HIZ_SLACK * binade;
+}
+
+// The color buffer is filled with c before anything is drawn this frame
+static inline void raster_set_clear(Raster *rs, uint32_t c)
+{
+    rs->clear = 1;
+    rs->clear_color = c;
+}
+
+// Color and depth resets in a single pass, row by row so both rows are
+// written while hot; -O3 turns each row into wide stores
+static inline void raster_clear(Raster *rs)
+{
+    if (!rs->clear && !rs->clear_depth) return;
+    buffer *buf = rs->target;
+    uint32_t c = rs->clear_color;
+    int clear_color = rs->clear;
+    int clear_depth = rs->clear_depth;
+    int w = buf->w;
+
+    for (int y = 0; y < (int)buf->h; y++)
+    {
+        uint32_t *color = (uint32_t *)buf->mem + y * w;
+        float *depth = buf->depth_buffer + y * w;
+        if (clear_color)
+            for (int i = 0; i < w; i++) color[i] = c;
+        if (clear_depth)
+            for (int i = 0; i < w; i++) depth[i] = 1.0f;
+    }
+    rs->clear = 0;
+    rs->clear_depth = 0;
+}
+
+// The ground is drawn per tile before that tile's triangles
+static inline void raster_set_ground(Raster *rs, Ground ground)
+{
+    rs->ground = ground;
+    rs->ground.active = 1;
+    rs->ground.depth_scale = rs->depth_scale;
+    rs->ground.depth_offset = rs->depth_offset;
+}
+
+static inline void raster_bin_push(RasterBin *bin, int index)
+{
+    if (bin->count >= bin->capacity)
+    {
+        bin->capacity = bin->capacity ? bin->capacity * 2 : 64;
+        bin->items = (int *)realloc(bin->items, sizeof(int) * bin->capacity);
+    }
+    bin->items[bin->count++] = index;
+}
+
+// Vertices are snapped to a 1/(1 << g_raster_subpixel_bits) pixel grid so shared
+// edges evaluate bit-identically for both triangles, and samples sit on pixel
+// centers. The top-left rule then gives every edge pixel exactly one owner.
+static inline void raster_setup(Raster *rs, const RenderTri *rt)
+{
+    const Vec3 *screen = rt->tri;
+    buffer *buf = rs->target;
+    const int bits = g_raster_subpixel_bits;
+    const int64_t one = (int64_t)1 << bits;
+    const int64_t half = one >> 1;
+
+    int64_t vx[3], vy[3];
+    float vz[3];
+    int order[3] = { 0, 1, 2 };
+    for (int i = 0; i < 3; i++)
+    {
+        if (fabsf(screen[i].x) > RASTER_MAX_COORD || fabsf(screen[i].y) > RASTER_MAX_COORD) return;
+        vx[i] = (int64_t)lrintf(screen[i].x * one);
+        vy[i] = (int64_t)lrintf(screen[i].y * one);
+        vz[i] = fminf(fmaxf(screen[i].z, 0.0f), 1.0f);
+    }
+
+    int64_t area = (vx[1] - vx[0]) * (vy[2] - vy[0]) - (vy[1] - vy[0]) * (vx[2] - vx[0]);
+    if (area == 0) return;
+    if (area < 0)
+    {
+        int64_t tx = vx[1]; vx[1] = vx[2]; vx[2] = tx;
+        int64_t ty = vy[1]; vy[1] = vy[2]; vy[2] = ty;
+        float tz = vz[1]; vz[1] = vz[2]; vz[2] = tz;
+        order[1] = 2;
+        order[2] = 1;
+        area = -area;
+    }
+
+    // A pixel is covered when its center (x*one + half) lies inside
+    int64_t lo_x = vx[0], hi_x = vx[0], lo_y = vy[0], hi_y = vy[0];
+    for (int i = 1; i < 3; i++)
+    {
+        if (vx[i] < lo_x) lo_x = vx[i];
+        if (vx[i] > hi_x) hi_x = vx[i];
+        if (vy[i] < lo_y) lo_y = vy[i];
+        if (vy[i] > hi_y) hi_y = vy[i];
+    }
+    int64_t minX = -((half - lo_x) >> bits);
+    int64_t minY = -((half - lo_y) >> bits);
+    int64_t maxX = (hi_x - half) >> bits;
+    int64_t maxY = (hi_y - half) >> bits;
+    if (minX < 0) minX = 0;
+    if (minY < 0) minY = 0;
+    if (maxX > (int64_t)buf->w - 1) maxX = buf->w - 1;
+    if (maxY > (int64_t)buf->h - 1) maxY = buf->h - 1;
+    if (minX > maxX || minY > maxY) return;
+
+    if (rs->tri_count >= rs->tri_capacity)
+    {
+        rs->tri_capacity *= 2;
+        rs->tris = (RasterTri *)realloc(rs->tris, sizeof(RasterTri) * rs->tri_capacity);
+    }
+    int index = rs->tri_count++;
+    RasterTri *t = &rs->tris[index];
+    rs->stats.tris_rasterized++;
+    t->wide = 0;
+
+    for (int i = 0; i < 3; i++)
+    {
+        // Edge i runs from vertex i+1 to i+2, opposite vertex i
+        int a = (i + 1) % 3;
+        int b = (i + 2) % 3;
+        int64_t dx = vx[b] - vx[a];
+        int64_t dy = vy[b] - vy[a];
+
+        // Positive area with y down: top edges run +x, left edges run -y
+        int top_left = (dy == 0 && dx > 0) || dy < 0;
+
+        t->edge_a[i] = -dy * one;
+        t->edge_b[i] = dx * one;
+        t->edge_c[i] = dx * (half - vy[a]) - dy * (half - vx[a]) - (top_left ? 0 : 1);
+        if (llabs(t->edge_a[i]) >= SPAN_MAX_STEP) t->wide = 1;
+    }
+
+    float x0 = (float)vx[0] / one, y0 = (float)vy[0] / one;
+    float x1 = (float)vx[1] / one - x0, y1 = (float)vy[1] / one - y0;
+    float x2 = (float)vx[2] / one - x0, y2 = (float)vy[2] / one - y0;
+    float sz[3];
+    for (int i = 0; i < 3; i++) sz[i] = vz[i] * rs->depth_scale + rs->depth_offset;
+    float z1 = sz[1] - sz[0], z2 = sz[2] - sz[0];
+    float inv_area = 1.0f / (x1 * y2 - y1 * x2);
+    t->z_dx = (z1 * y2 - y1 * z2) * inv_area;
+    t->z_dy = (x1 * z2 - z1 * x2) * inv_area;
+    t->z_c = sz[0] + t->z_dx * (0.5f - x0) + t->z_dy * (0.5f - y0);
+    t->z_min = fminf(sz[0], fminf(sz[1], sz[2]));
+
+    t->color = rt->color[0];
+    t->texture = rt->texture;
+    if (rs->shade != SHADE_FLAT || rt->texture)
+    {
+        // Channels get the +0.5 bias SpanShade expects
+        float attr[3][4];
+        for (int i = 0; i < 3; i++)
+        {
+            uint32_t c = rt->color[order[i]];
+            attr[i][0] = ((c >> 16) & 0xFF) + 0.5f;
+            attr[i][1] = ((c >> 8) & 0xFF) + 0.5f;
+            attr[i][2] = (c & 0xFF) + 0.5f;
+            attr[i][3] = rt->fog[order[i]];
+        }
+        for (int k = 0; k < 4; k++)
+        {
+            float a1 = attr[1][k] - attr[0][k], a2 = attr[2][k] - attr[0][k];
+            t->shade_dx[k] = (a1 * y2 - y1 * a2) * inv_area;
+            t->shade_dy[k] = (x1 * a2 - a1 * x2) * inv_area;
+            t->shade_c[k] = attr[0][k] + t->shade_dx[k] * (0.5f - x0) + t->shade_dy[k] * (0.5f - y0);
+            t->shade_step[k] = raster_fixed(t->shade_dx[k]);
+            t->shade_step_y[k] = raster_fixed(t->shade_dy[k]);
+        }
+    }
+    if (rt->texture)
+    {
+        // Screen z is linear in 1/w, which gives it back
+        float attr[3][3];
+        for (int i = 0; i < 3; i++)
+        {
+            float q = view_depth_inv_z(vz[i]);
+            attr[i][0] = q;
+            attr[i][1] = rt->uv[order[i]].x * q;
+            attr[i][2] = rt->uv[order[i]].y * q;
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            float a1 = attr[1][k] - attr[0][k], a2 = attr[2][k] - attr[0][k];
+            t->tex_dx[k] = (a1 * y2 - y1 * a2) * inv_area;
+            t->tex_dy[k] = (x1 * a2 - a1 * x2) * inv_area;
+            t->tex_c[k] = attr[0][k] + t->tex_dx[k] * (0.5f - x0) + t->tex_dy[k] * (0.5f - y0);
+        }
+    }
+    t->min_x = (int)minX;
+    t->min_y = (int)minY;
+    t->max_x = (int)maxX;
+    t->max_y = (int)maxY;
+
+    int tx0 = t->min_x / RASTER_TILE_W, tx1 = t->max_x / RASTER_TILE_W;
+    int ty0 = t->min_y / RASTER_TILE_H, ty1 = t->max_y / RASTER_TILE_H;
+    for (int ty = ty0; ty <= ty1; ty++)
+        for (int tx = tx0; tx <= tx1; tx++)
+            raster_bin_push(&rs->bins[ty * rs->tiles_x + tx], index);
+}
+
+static inline void raster_submit(Raster *rs, Vec3 screen[3], uint32_t color)
+{
+    uint32_t colors[3] = { color, color, color };
+    float fog[3] = { 0.0f, 0.0f, 0.0f };
+    rs->stats.tris_submitted++;
+    render_queue_push(&rs->queue, screen, colors, fog);
+}
+
+// Colors and fog table coordinates per vertex, for the shaded modes
+static inline void raster_submit_shaded(Raster *rs, Vec3 screen[3], const uint32_t colors[3], const float fog[3])
+{
+    rs->stats.tris_submitted++;
+    render_queue_push(&rs->queue, screen, colors, fog);
+}
+
+// As raster_submit_shaded, with the texture the colors scale and the texture
+// coordinates per vertex; colors must not be fogged yet
+static inline void raster_submit_textured(Raster *rs, Vec3 screen[3], const uint32_t colors[3], const float fog[3], const Vec2 uv[3], const Texture *texture)
+{
+    rs->stats.tris_submitted++;
+    RenderTri *t = render_queue_push(&rs->queue, screen, colors, fog);
+    for (int i = 0; i < 3; i++) t->uv[i] = uv[i];
+    t->texture = texture;
+}
+
+// The span kernel variant for the current settings. Per-pixel fog is the
+// only feature the kernels apply themselves; lighting and the other fog
+// modes are already part of the submitted colors.
+static inline int raster_features(const Raster *rs)
+{
+    int features = 0;
+    if (rs->depth_test) features |= SPAN_DEPTH_TEST;
+    if (rs->shade != SHADE_FLAT) features |= SPAN_SMOOTH;
+    if (rs->shade == SHADE_PIXEL && g_fog_active) features |= SPAN_FOG;
+    return features;
+}
+
+// Rasterize everything submitted since raster_begin in rs->order, tiles
+// spread across the pool
+static inline void raster_flush(Raster *rs)
+{
+    rs->features = raster_features(rs);
+
+    // Without the depth test, drawing back to front makes it a painter's
+    // algorithm instead of leaving whatever came last on top
+    RenderOrder draw_order = rs->depth_test ? rs->order : RENDER_BACK_TO_FRONT;
+    const uint64_t *order = render_queue_sort(&rs->queue, draw_order);
+    for (int i = 0; i < rs->queue.count; i++)
+        raster_setup(rs, &rs->queue.tris[(uint32_t)order[i]]);
+    rs->queue.count = 0;
+
+    raster_clear(rs);
+
+    pthread_mutex_lock(&rs->lock);
+    rs->next_tile = 0;
+    rs->busy = rs->worker_count;
+    rs->generation++;
+    pthread_cond_broadcast(&rs->work_cv);
+    pthread_mutex_unlock(&rs->lock);
+
+    raster_run_tiles(rs);
+
+    pthread_mutex_lock(&rs->lock);
+    while (rs->busy > 0)
+        pthread_cond_wait(&rs->done_cv, &rs->lock);
+    pthread_mutex_unlock(&rs->lock);
+
+    for (int i = 0; i < rs->tile_count; i++)
+        rs->bins[i].count = 0;
+    rs->tri_count = 0;
+    rs->ground.active = 0;
+}
+
+#endif // RASTER_H
@@ -0,0 +1,299 @@
+#ifndef SCALE_H
+#define SCALE_H
+
+#include <string.h>
+#include "game.h"
+#include "span.h"
+
+// Dynamic resolution: the scene is drawn into a smaller buffer and
+// upscaled into the frame, so cost follows the scale squared while the
+// HUD and editor still draw at native resolution. Scales snap to
+// SCALE_STEP so the scene buffer only changes size on a real adjustment.
+#define SCALE_MIN 0.5f
+#define SCALE_STEP 0.05f
+#define SCALE_AUTO -1.0f
+
+// Frames averaged after a change before the next one, and the band around
+// the target inside which the scale is left alone
+#define SCALE_SETTLE 8
+#define SCALE_SLACK 0.1f
+
+// Neighbours differing by more than this in any channel are taken as an
+// edge by UPSCALE_EDGE and not blended across
+#define SCALE_EDGE_CONTRAST 48
+
+typedef enum
+{
+    UPSCALE_NEAREST,
+    UPSCALE_BILINEAR,
+    UPSCALE_EDGE,    // bilinear, but nearest across strong edges
+    UPSCALE_FILTER_COUNT
+}
+UpscaleFilter;
+
+static const char *g_upscale_names[UPSCALE_FILTER_COUNT] = { "nearest", "bilinear", "edge" };
+
+typedef struct
+{
+    float scale;
+    int automatic;
+    float target_ms;
+    UpscaleFilter filter;
+
+    // Render cost averaged since the last change, over samples frames
+    float average_ms;
+    int samples;
+    uint32_t out_w;
+    uint32_t out_h;
+
+    // Scene target when scaled; capacity is in pixels
+    buffer scene;
+    uint32_t capacity;
+
+    // Source texel and weight per output column, and two source rows
+    // already resampled to output width, tagged with their source row
+    int *taps;
+    uint32_t *rows[2];
+    int row_y[2];
+    uint32_t tap_capacity;
+}
+RenderScale;
+
+static inline float scale_snap(float s)
+{
+    s = roundf(s / SCALE_STEP) * SCALE_STEP;
+    return s < SCALE_MIN ? SCALE_MIN : (s > 1.0f ? 1.0f : s);
+}
+
+// scale is fixed in [SCALE_MIN, 1] or SCALE_AUTO to chase target_ms
+static inline void scale_init(RenderScale *s, float scale, float target_ms, UpscaleFilter filter)
+{
+    *s = (RenderScale){0};
+    s->automatic = scale < 0.0f;
+    s->scale = s->automatic ? 1.0f : scale_snap(scale);
+    s->target_ms = target_ms;
+    s->filter = filter;
+}
+
+static inline void scale_free(RenderScale *s)
+{
+    free(s->scene.mem);
+    free(s->scene.depth_buffer);
+    free(s->taps);
+    free(s->rows[0]);
+    free(s->rows[1]);
+    *s = (RenderScale){0};
+}
+
+// Buffer to draw the scene into for a frame of out's size: out itself at
+// full scale, else the scene buffer at the scaled size
+static inline buffer *scale_target(RenderScale *s, buffer *out)
+{
+    // Timings at another output size say nothing about this one
+    if (out->w != s->out_w || out->h != s->out_h)
+    {
+        s->out_w = out->w;
+        s->out_h = out->h;
+        s->samples = 0;
+    }
+    if (s->scale >= 1.0f) return out;
+
+    uint32_t w = (uint32_t)(out->w * s->scale + 0.5f);
+    uint32_t h = (uint32_t)(out->h * s->scale + 0.5f);
+    if (w < 1) w = 1;
+    if (h < 1) h = 1;
+    if (w * h > s->capacity)
+    {
+        s->capacity = w * h;
+        s->scene.mem = (uint8_t *)realloc(s->scene.mem, (size_t)s->capacity * 4);
+        s->scene.depth_buffer = (float *)realloc(s->scene.depth_buffer, sizeof(float) * s->capacity);
+    }
+    s->scene.w = w;
+    s->scene.h = h;
+    s->scene.pitch = w * 4;
+    s->scene.size = (uint64_t)s->scene.pitch * h;
+    return &s->scene;
+}
+
+// Feeds the render cost of the last frame to the automatic scale. Cost is
+// taken as proportional to pixels: over target it drops straight to the
+// scale predicted to fit, under it it climbs one step at a time and only
+// once that step is predicted to fit with some slack, so it doesn't bounce.
+static inline void scale_update(RenderScale *s, uint64_t ns)
+{
+    if (!s->automatic || s->target_ms <= 0.0f) return;
+    float ms = (float)(ns / 1e6);
+    s->average_ms = s->samples ? s->average_ms + (ms - s->average_ms) * 0.25f : ms;
+    if (++s->samples < SCALE_SETTLE) return;
+
+    float next = s->scale;
+    if (s->average_ms > s->target_ms * (1.0f + SCALE_SLACK))
+    {
+        next = s->scale * sqrtf(s->target_ms / s->average_ms);
+        next = floorf(next / SCALE_STEP) * SCALE_STEP;
+    }
+    else if (s->scale < 1.0f)
+    {
+        float up = s->scale + SCALE_STEP;
+        float predicted = s->average_ms * (up * up) / (s->scale * s->scale);
+        if (predicted < s->target_ms * (1.0f - SCALE_SLACK)) next = up;
+    }
+    next = scale_snap(next);
+    if (next == s->scale) return;
+    s->scale = next;
+    s->samples = 0;
+}
+
+// a and b mixed by f / 256, two channels per multiply
+static inline uint32_t scale_lerp(uint32_t a, uint32_t b, uint32_t f)
+{
+    uint32_t rb = ((a & 0xFF00FFu) * (256 - f) + (b & 0xFF00FFu) * f) >> 8;
+    uint32_t ag = ((a >> 8) & 0xFF00FFu) * (256 - f) + ((b >> 8) & 0xFF00FFu) * f;
+    return (rb & 0xFF00FFu) | (ag & 0xFF00FF00u);
+}
+
+static inline int scale_edge(uint32_t a, uint32_t b)
+{
+    int dr = (int)((a >> 16) & 0xFF) - (int)((b >> 16) & 0xFF);
+    int dg = (int)((a >> 8) & 0xFF) - (int)((b >> 8) & 0xFF);
+    int db = (int)(a & 0xFF) - (int)(b & 0xFF);
+    return abs(dr) > SCALE_EDGE_CONTRAST || abs(dg) > SCALE_EDGE_CONTRAST || abs(db) > SCALE_EDGE_CONTRAST;
+}
+
+static inline uint32_t scale_mix(uint32_t a, uint32_t b, uint32_t f, int edges)
+{
+    if (edges && scale_edge(a, b)) return f < 128 ? a : b;
+    return scale_lerp(a, b, f);
+}
+
+// Source coordinate of output pixel i's center in 16.16, clamped to the
+// source so the outermost pixels repeat instead of reading past it
+static inline int scale_source(int i, int step, int max)
+{
+    int p = i * step + step / 2 - 0x8000;
+    return p < 0 ? 0 : (p > max ? max : p);
+}
+
+#ifdef SPAN_X86
+
+// Rows a and b mixed by f / 256 into out, four pixels at a time; with
+// edges, pixels whose rows differ strongly take the nearer row instead.
+// Returns how many pixels were done.
+__attribute__((target("sse2")))
+static inline int scale_blend_sse2(const uint32_t *a, const uint32_t *b, uint32_t *out, int w, uint32_t f, int edges)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i wa = _mm_set1_epi16((short)(256 - f));
+    __m128i wb = _mm_set1_epi16((short)f);
+    __m128i low = _mm_set1_epi32(0xFF);
+    __m128i contrast = _mm_set1_epi32(SCALE_EDGE_CONTRAST);
+    int i = 0;
+    for (; i + 4 <= w; i += 4)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa), _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa), _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+        __m128i c = _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+        if (edges)
+        {
+            // Largest channel difference per pixel, alpha left out
+            __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+            __m128i m = _mm_max_epu8(_mm_max_epu8(d, _mm_srli_epi32(d, 8)), _mm_srli_epi32(d, 16));
+            __m128i edge = _mm_cmpgt_epi32(_mm_and_si128(m, low), contrast);
+            __m128i near = f < 128 ? va : vb;
+            c = _mm_or_si128(_mm_and_si128(edge, near), _mm_andnot_si128(edge, c));
+        }
+        _mm_storeu_si128((__m128i *)(out + i), c);
+    }
+    return i;
+}
+
+#endif // SPAN_X86
+
+// Source row y resampled horizontally to out_w pixels
+static inline void scale_row(const RenderScale *s, const buffer *src, int y, uint32_t *out, int out_w, int edges)
+{
+    const uint32_t *row = (const uint32_t *)(src->mem + (size_t)y * src->pitch);
+    int last = (int)src->w - 1;
+    for (int x = 0; x < out_w; x++)
+    {
+        int p = s->taps[x];
+        int x0 = p >> 16;
+        int x1 = x0 < last ? x0 + 1 : x0;
+        out[x] = scale_mix(row[x0], row[x1], (p >> 8) & 0xFF, edges);
+    }
+}
+
+static inline void scale_blend(const uint32_t *a, const uint32_t *b, uint32_t *out, int w, uint32_t f, int edges)
+{
+    int i = 0;
+#ifdef SPAN_X86
+    i = scale_blend_sse2(a, b, out, w, f, edges);
+#endif
+    for (; i < w; i++) out[i] = scale_mix(a[i], b[i], f, edges);
+}
+
+// Resamples src over all of dst with s->filter. Bilinear is done in two
+// passes: each source row is resampled to dst's width once and kept while
+// the output rows between it and the next one blend the pair vertically.
+static inline void scale_upscale(RenderScale *s, const buffer *src, buffer *dst)
+{
+    int out_w = (int)dst->w, out_h = (int)dst->h;
+    if (dst->w > s->tap_capacity)
+    {
+        s->tap_capacity = dst->w;
+        s->taps = (int *)realloc(s->taps, sizeof(int) * s->tap_capacity);
+        s->rows[0] = (uint32_t *)realloc(s->rows[0], sizeof(uint32_t) * s->tap_capacity);
+        s->rows[1] = (uint32_t *)realloc(s->rows[1], sizeof(uint32_t) * s->tap_capacity);
+    }
+
+    int step_x = (int)(((int64_t)src->w << 16) / out_w);
+    int step_y = (int)(((int64_t)src->h << 16) / out_h);
+    int max_x = ((int)src->w - 1) << 16, max_y = ((int)src->h - 1) << 16;
+
+    if (s->filter == UPSCALE_NEAREST)
+    {
+        for (int x = 0; x < out_w; x++) s->taps[x] = (x * step_x + step_x / 2) >> 16;
+        int prev = -1;
+        for (int y = 0; y < out_h; y++)
+        {
+            uint32_t *out = (uint32_t *)(dst->mem + (size_t)y * dst->pitch);
+            int sy = (y * step_y + step_y / 2) >> 16;
+            if (sy == prev)
+            {
+                memcpy(out, dst->mem + (size_t)(y - 1) * dst->pitch, sizeof(uint32_t) * out_w);
+                continue;
+            }
+            const uint32_t *row = (const uint32_t *)(src->mem + (size_t)sy * src->pitch);
+            for (int x = 0; x < out_w; x++) out[x] = row[s->taps[x]];
+            prev = sy;
+        }
+        return;
+    }
+
+    int edges = s->filter == UPSCALE_EDGE;
+    for (int x = 0; x < out_w; x++) s->taps[x] = scale_source(x, step_x, max_x);
+    s->row_y[0] = s->row_y[1] = -1;
+    for (int y = 0; y < out_h; y++)
+    {
+        int p = scale_source(y, step_y, max_y);
+        int y0 = p >> 16;
+        int y1 = y0 < (int)src->h - 1 ? y0 + 1 : y0;
+        uint32_t f = (p >> 8) & 0xFF;
+
+        // Consecutive source rows differ in parity, so each keeps its own slot
+        for (int r = y0; r <= y1; r++)
+        {
+            if (s->row_y[r & 1] == r) continue;
+            scale_row(s, src, r, s->rows[r & 1], out_w, edges);
+            s->row_y[r & 1] = r;
+        }
+
+        uint32_t *out = (uint32_t *)(dst->mem + (size_t)y * dst->pitch);
+        if (f == 0 || y1 == y0) memcpy(out, s->rows[y0 & 1], sizeof(uint32_t) * out_w);
+        else scale_blend(s->rows[y0 & 1], s->rows[y1 & 1], out, out_w, f, edges);
+    }
+}
+
+#endif // SCALE_H
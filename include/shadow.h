@@ -0,0 +1,249 @@
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include "game.h"
+#include "util.h"
+#include "clip.h"
+#include "raster.h"
+#include "level.h"
+
+// Shadow map pass: wall depth from the light, drawn by the regular tiled
+// rasterizer into the map's own target. The map does not depend on the
+// camera, so it is kept until the light or the level changes.
+
+static inline void shadow_init(ShadowMap *m, int size)
+{
+    *m = (ShadowMap){0};
+    if (size <= 0) return;
+    m->size = size;
+    m->enabled = 1;
+
+    // Room for every face; shadow_frame sets the height actually drawn
+    int texels = size * size * SHADOW_MAX_FACES;
+    m->target.w = size;
+    m->target.h = size;
+    m->target.shadow_w = size;
+    m->target.shadow_h = size * SHADOW_MAX_FACES;
+    m->target.shadow_depth = (float *)malloc(sizeof(float) * texels);
+    m->target.depth_buffer = m->target.shadow_depth;
+
+    // Only depth matters, but the span kernels write color too
+    m->target.mem = (uint8_t *)malloc(sizeof(uint32_t) * texels);
+
+    m->blocks = (size + SHADOW_BLOCK - 1) / SHADOW_BLOCK;
+    m->coarse = (float *)malloc(sizeof(float) * 2 * m->blocks * m->blocks * SHADOW_MAX_FACES);
+    printf("[LOG] Shadow map %dx%d\n", size, size);
+}
+
+static inline void shadow_free(ShadowMap *m)
+{
+    free(m->target.shadow_depth);
+    free(m->target.mem);
+    free(m->coarse);
+    *m = (ShadowMap){0};
+}
+
+static inline int shadow_stale(const ShadowMap *m, const Level *level, Light light)
+{
+    return !m->valid
+        || m->level != (const void *)level
+        || m->level_revision != level->revision
+        || m->light_directional != light.is_directional
+        || memcmp(&m->light_position, &light.position, sizeof(Vec3)) != 0
+        || memcmp(&m->light_direction, &light.direction, sizeof(Vec3)) != 0;
+}
+
+// Right, up and forward of the point light faces, in the order shadow_coord
+// numbers them: down, +x, -x, +z, -z
+static const Vec3 g_shadow_cube_axes[SHADOW_MAX_FACES][3] = {
+    { {  1, 0,  0 }, { 0, 0, 1 }, {  0, 1,  0 } },
+    { {  0, 0,  1 }, { 0, 1, 0 }, {  1, 0,  0 } },
+    { {  0, 0, -1 }, { 0, 1, 0 }, { -1, 0,  0 } },
+    { { -1, 0,  0 }, { 0, 1, 0 }, {  0, 0,  1 } },
+    { {  1, 0,  0 }, { 0, 1, 0 }, {  0, 0, -1 } },
+};
+
+// Orients the map for light: the cube faces around a point light, or one
+// view along a directional light's rays fitted around every wall
+static inline int shadow_frame(ShadowMap *m, const Level *level, Light light)
+{
+    const Mesh *mesh = &level->mesh;
+    m->perspective = !light.is_directional;
+    if (m->perspective)
+    {
+        m->faces = SHADOW_MAX_FACES;
+        m->origin = light.position;
+        memcpy(m->axis, g_shadow_cube_axes, sizeof(m->axis));
+        m->scale = 0.5f * m->size;
+        m->target.h = m->faces * m->size;
+        return 1;
+    }
+    if (mesh->quad_count == 0) return 0;
+    m->faces = 1;
+    m->target.h = m->size;
+
+    // light_space is linear, so its images of the unit vectors give the basis
+    Vec3 *axis = m->axis[0];
+    Vec3 ex = light_space((Vec3){ 1.0f, 0.0f, 0.0f }, light);
+    Vec3 ey = light_space((Vec3){ 0.0f, 1.0f, 0.0f }, light);
+    Vec3 ez = light_space((Vec3){ 0.0f, 0.0f, 1.0f }, light);
+    axis[0] = (Vec3){ ex.x, ey.x, ez.x };
+    axis[1] = (Vec3){ ex.y, ey.y, ez.y };
+    axis[2] = (Vec3){ -ex.z, -ey.z, -ez.z };
+
+    Vec3 lo = { INFINITY, INFINITY, INFINITY };
+    Vec3 hi = { -INFINITY, -INFINITY, -INFINITY };
+    for (int i = 0; i < mesh->quad_count * 4; i++)
+    {
+        Vec3 p = mesh->verts[i];
+        Vec3 l = { vec3_dot(p, axis[0]), vec3_dot(p, axis[1]), vec3_dot(p, axis[2]) };
+        lo = (Vec3){ fminf(lo.x, l.x), fminf(lo.y, l.y), fminf(lo.z, l.z) };
+        hi = (Vec3){ fmaxf(hi.x, l.x), fmaxf(hi.y, l.y), fmaxf(hi.z, l.z) };
+    }
+
+    // Centered on the walls, one texel of margin, casters in 0.05..0.95
+    Vec3 c = vec3_scale(vec3_add(lo, hi), 0.5f);
+    m->origin = vec3_add(vec3_add(vec3_scale(axis[0], c.x), vec3_scale(axis[1], c.y)), vec3_scale(axis[2], c.z));
+    float extent = fmaxf(hi.x - lo.x, hi.y - lo.y) + 1.0f;
+    m->scale = (m->size - 2) / extent;
+    m->depth_scale = 0.9f / (hi.z - lo.z + 1.0f);
+    return 1;
+}
+
+// The near plane and the four sides of a point light face's frustum, all
+// through the light
+static inline void shadow_face_planes(const ShadowMap *m, int face, Plane planes[5])
+{
+    const Vec3 *axis = m->axis[face];
+    planes[0] = (Plane){ axis[2], vec3_dot(axis[2], m->origin) + SHADOW_NEAR };
+    for (int i = 0; i < 4; i++)
+    {
+        Vec3 side = vec3_scale(axis[i >> 1], (i & 1) ? -1.0f : 1.0f);
+        Vec3 n = vec3_add(axis[2], side);
+        planes[i + 1] = (Plane){ n, vec3_dot(n, m->origin) };
+    }
+}
+
+// One baked wall quad into one face, clipped to the face's frustum for
+// point lights; rows of face f start at f * size
+static inline void shadow_submit_quad(const ShadowMap *m, Raster *rs, int face, const Plane *planes, const Vec3 *verts)
+{
+    Polygon poly = { .num_vertices = 4 };
+    for (int i = 0; i < 4; i++) poly.vertices[i] = verts[i];
+    if (m->perspective)
+    {
+        int all = ~0, any = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            int code = clip_outcode(planes, 5, verts[i]);
+            all &= code;
+            any |= code;
+        }
+        if (all) return;
+        polygon_clip_planes(&poly, planes, any);
+        if (poly.num_vertices < 3) return;
+    }
+
+    Vec3 screen[MAX_POLY_VERTS];
+    float offset = (float)(face * m->size);
+    for (int i = 0; i < poly.num_vertices; i++)
+    {
+        ShadowCoord c = shadow_face_coord(m, face, vec3_sub(poly.vertices[i], m->origin), 0.0f);
+        screen[i] = (Vec3){ c.u, c.v + offset, c.depth };
+    }
+    for (int i = 1; i + 1 < poly.num_vertices; i++)
+    {
+        Vec3 tri[3] = { screen[0], screen[i], screen[i + 1] };
+        raster_submit(rs, tri, 0);
+    }
+}
+
+// Fills coarse from the freshly drawn faces. Blocks overlap their right
+// and lower neighbours by a texel, so a 2x2 footprint starting in a block
+// lies wholly inside it.
+static inline void shadow_reduce(ShadowMap *m)
+{
+    const float *texels = m->target.shadow_depth;
+    for (int face = 0; face < m->faces; face++)
+    {
+        for (int by = 0; by < m->blocks; by++)
+        {
+            for (int bx = 0; bx < m->blocks; bx++)
+            {
+                float lo = INFINITY, hi = -INFINITY;
+                int y1 = (by + 1) * SHADOW_BLOCK + 1 < m->size ? (by + 1) * SHADOW_BLOCK + 1 : m->size;
+                int x1 = (bx + 1) * SHADOW_BLOCK + 1 < m->size ? (bx + 1) * SHADOW_BLOCK + 1 : m->size;
+                for (int y = by * SHADOW_BLOCK; y < y1; y++)
+                {
+                    const float *row = texels + (face * m->size + y) * m->size;
+                    for (int x = bx * SHADOW_BLOCK; x < x1; x++)
+                    {
+                        lo = fminf(lo, row[x]);
+                        hi = fmaxf(hi, row[x]);
+                    }
+                }
+                float *c = &m->coarse[2 * ((face * m->blocks + by) * m->blocks + bx)];
+                c[0] = lo;
+                c[1] = hi;
+            }
+        }
+    }
+}
+
+// Re-renders the map when the light or the level changed since the last
+// call; lookups treat an invalid map as fully lit
+static inline void shadow_update(ShadowMap *m, Raster *rs, Level *level, Light light)
+{
+    if (!m->enabled)
+    {
+        m->valid = 0;
+        return;
+    }
+    level_bake(level);
+    if (!shadow_stale(m, level, light)) return;
+
+    m->valid = shadow_frame(m, level, light);
+    m->light_position = light.position;
+    m->light_direction = light.direction;
+    m->light_directional = light.is_directional;
+    m->level = level;
+    m->level_revision = level->revision;
+    if (!m->valid) return;
+
+    // Depth only: flat kernels with the depth test, whatever the frame uses
+    ShadeMode shade = rs->shade;
+    int depth_test = rs->depth_test;
+    rs->shade = SHADE_FLAT;
+    rs->depth_test = 1;
+
+    // The map has a depth buffer of its own; the frame's epoch carries on
+    // afterwards as if this pass never happened
+    float *depth_buffer = rs->depth_buffer;
+    uint32_t depth_size = rs->depth_size;
+    int depth_frame = rs->depth_frame;
+
+    raster_begin(rs, &m->target);
+
+    // Lookups compare light depth with the texels as they are, so the map
+    // stores it unencoded; each pass clears it anyway
+    rs->depth_scale = 1.0f;
+    rs->depth_offset = 0.0f;
+    rs->depth_slack = RASTER_HIZ_SLACK;
+    for (int face = 0; face < m->faces; face++)
+    {
+        Plane planes[5];
+        if (m->perspective) shadow_face_planes(m, face, planes);
+        for (int q = 0; q < level->mesh.quad_count; q++)
+            shadow_submit_quad(m, rs, face, planes, &level->mesh.verts[q * 4]);
+    }
+    raster_flush(rs);
+    shadow_reduce(m);
+
+    rs->shade = shade;
+    rs->depth_test = depth_test;
+    rs->depth_buffer = depth_buffer;
+    rs->depth_size = depth_size;
+    rs->depth_frame = depth_frame;
+}
+
+#endif // SHADOW_H
@@ -0,0 +1,520 @@
+#ifndef SPAN_H
+#define SPAN_H
+
+#include "game.h"
+#include "util.h"
+#include "texture.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SPAN_X86
+#endif
+
+// Edge values are narrowed to int32 per block of lanes. Clamping the block
+// start to +-SPAN_SAT keeps the sign of every lane as long as the per-pixel
+// step stays below SPAN_MAX_STEP. Triangles with a larger step are marked
+// wide when they are set up and take the scalar kernel instead.
+#define SPAN_SAT (1 << 30)
+#define SPAN_MAX_STEP (1 << 26)
+
+// Feature bits a span kernel is specialized for. Every combination is
+// compiled from the same template bodies below, with the bits as constants,
+// so a kernel carries no branches for features it does not use.
+//
+//   SPAN_DEPTH_TEST  test z against the depth buffer and store it on a pass;
+//                    without it every covered pixel is written, depth untouched
+//   SPAN_SMOOTH      color interpolated across the span instead of constant
+//   SPAN_FOG         fog looked up per pixel and blended over the color
+//   SPAN_TEXTURE     a texel, perspective correct, scaled by the color
+//                    before fog
+#define SPAN_DEPTH_TEST 1
+#define SPAN_SMOOTH 2
+#define SPAN_FOG 4
+#define SPAN_TEXTURE 8
+#define SPAN_VARIANTS 16
+
+// Added to texel coordinates before truncating, so the small negative ones
+// interpolation leaves at a triangle's edge wrap instead of rounding to 0;
+// a multiple of every texture side
+#define SPAN_TEXTURE_WRAP 65536.0f
+
+// Interpolated shading for one span in 16.16 fixed point: red, green, blue
+// and the fog table coordinate at the first pixel, and their step per pixel.
+// Channels carry a +0.5 bias so rounding inside the triangle never dips below
+// zero or reaches 256. Kernels without SPAN_SMOOTH use color instead.
+//
+// SPAN_TEXTURE kernels also step 1/w, u/w and v/w in tq, with u and v in
+// texels of the mip level texels points at, and divide per pixel.
+typedef struct
+{
+    uint32_t color;
+    int32_t v[4];
+    int32_t dx[4];
+
+    const uint32_t *texels;
+    int tex_w_log2;
+    int tex_w_mask;
+    int tex_h_mask;
+    float tq[3];
+    float tq_dx[3];
+}
+SpanShade;
+
+// Writes one row of a triangle: count pixels starting at color/depth, with
+// edge values w at the first pixel stepping by a per pixel, depth z stepping
+// by z_dx. A pixel is written when all edges are >= 0 and z passes the test.
+// Returns the number of pixels written.
+typedef int (*SpanKernel)(
+    uint32_t *color,
+    float *depth,
+    int count,
+    const int64_t w[3],
+    const int64_t a[3],
+    float z,
+    float z_dx,
+    const SpanShade *s);
+
+// Template bodies are only ever called with constant features
+#define SPAN_TEMPLATE static inline __attribute__((always_inline))
+
+static inline uint32_t span_pack(int32_t r, int32_t g, int32_t b)
+{
+    return 0xFF000000u | ((uint32_t)r & 0xFF0000u) | (((uint32_t)g >> 8) & 0xFF00u) | ((uint32_t)b >> 16);
+}
+
+static inline int32_t span_sat(int64_t v)
+{
+    if (v > SPAN_SAT) return SPAN_SAT;
+    if (v < -SPAN_SAT) return -SPAN_SAT;
+    return (int32_t)v;
+}
+
+// Blends the fog color over c by the table entry at fog coordinate f. Red
+// and blue share one multiply; neither can carry into the other.
+static inline uint32_t span_fog(uint32_t c, int32_t f)
+{
+    int index = f >> 16;
+    if (index < 0) index = 0;
+    if (index > FOG_LUT_SIZE - 1) index = FOG_LUT_SIZE - 1;
+    uint32_t k = (uint32_t)g_fog_lut[index];
+    uint32_t rb = (c & 0xFF00FFu) * (256 - k) + (g_fog_color & 0xFF00FFu) * k;
+    uint32_t g = (c & 0xFF00u) * (256 - k) + (g_fog_color & 0xFF00u) * k;
+    return 0xFF000000u | ((rb >> 8) & 0xFF00FFu) | ((g >> 8) & 0xFF00u);
+}
+
+// Nearest texel at (u, v), wrapping
+static inline uint32_t span_texel(const SpanShade *s, float u, float v)
+{
+    int tx = (int)(u + SPAN_TEXTURE_WRAP) & s->tex_w_mask;
+    int ty = (int)(v + SPAN_TEXTURE_WRAP) & s->tex_h_mask;
+    return s->texels[texture_texel_index(s->tex_w_log2, tx, ty)];
+}
+
+SPAN_TEMPLATE int span_scalar_body(
+    uint32_t *color,
+    float *depth,
+    int count,
+    const int64_t w[3],
+    const int64_t a[3],
+    float z,
+    float z_dx,
+    const SpanShade *s,
+    const int features)
+{
+    int64_t w0 = w[0], w1 = w[1], w2 = w[2];
+    int32_t r = s->v[0], g = s->v[1], b = s->v[2], f = s->v[3];
+    float q = s->tq[0], tu = s->tq[1], tv = s->tq[2];
+    int written = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if ((w0 | w1 | w2) >= 0 && (!(features & SPAN_DEPTH_TEST) || z < depth[i]))
+        {
+            uint32_t c = (features & SPAN_SMOOTH) ? span_pack(r, g, b) : s->color;
+            if (features & SPAN_TEXTURE)
+            {
+                float inv = 1.0f / q;
+                c = texture_modulate(span_texel(s, tu * inv, tv * inv), c);
+            }
+            if (features & SPAN_FOG) c = span_fog(c, f);
+            if (features & SPAN_DEPTH_TEST) depth[i] = z;
+            color[i] = c;
+            written++;
+        }
+        w0 += a[0];
+        w1 += a[1];
+        w2 += a[2];
+        z += z_dx;
+        if (features & SPAN_SMOOTH)
+        {
+            r += s->dx[0];
+            g += s->dx[1];
+            b += s->dx[2];
+        }
+        if (features & SPAN_FOG) f += s->dx[3];
+        if (features & SPAN_TEXTURE)
+        {
+            q += s->tq_dx[0];
+            tu += s->tq_dx[1];
+            tv += s->tq_dx[2];
+        }
+    }
+    return written;
+}
+
+#ifdef SPAN_X86
+
+// SSE2 has no 32-bit multiply, but every channel and weight here fits in
+// 16 bits and so does their product, so the 16-bit multiply does it
+__attribute__((target("sse2")))
+SPAN_TEMPLATE __m128i span_fog_sse2(__m128i c, __m128i f)
+{
+    __m128i index = _mm_srai_epi32(f, 16);
+    __m128i last = _mm_set1_epi32(FOG_LUT_SIZE - 1);
+    index = _mm_and_si128(index, _mm_cmpgt_epi32(index, _mm_set1_epi32(-1)));
+    __m128i over = _mm_cmpgt_epi32(index, last);
+    index = _mm_or_si128(_mm_and_si128(over, last), _mm_andnot_si128(over, index));
+
+    int32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, index);
+    __m128i k = _mm_setr_epi32(g_fog_lut[lanes[0]], g_fog_lut[lanes[1]], g_fog_lut[lanes[2]], g_fog_lut[lanes[3]]);
+    __m128i inv = _mm_sub_epi32(_mm_set1_epi32(256), k);
+    __m128i byte = _mm_set1_epi32(0xFF);
+
+    __m128i r = _mm_and_si128(_mm_srli_epi32(c, 16), byte);
+    __m128i g = _mm_and_si128(_mm_srli_epi32(c, 8), byte);
+    __m128i b = _mm_and_si128(c, byte);
+    r = _mm_add_epi32(_mm_mullo_epi16(r, inv), _mm_mullo_epi16(_mm_set1_epi32((g_fog_color >> 16) & 0xFF), k));
+    g = _mm_add_epi32(_mm_mullo_epi16(g, inv), _mm_mullo_epi16(_mm_set1_epi32((g_fog_color >> 8) & 0xFF), k));
+    b = _mm_add_epi32(_mm_mullo_epi16(b, inv), _mm_mullo_epi16(_mm_set1_epi32(g_fog_color & 0xFF), k));
+
+    return _mm_or_si128(_mm_or_si128(_mm_set1_epi32((int)0xFF000000), _mm_slli_epi32(_mm_srli_epi32(r, 8), 16)),
+        _mm_or_si128(_mm_and_si128(g, _mm_set1_epi32(0xFF00)), _mm_srli_epi32(b, 8)));
+}
+
+__attribute__((target("sse2")))
+SPAN_TEMPLATE int span_sse2_body(
+    uint32_t *color,
+    float *depth,
+    int count,
+    const int64_t w[3],
+    const int64_t a[3],
+    float z,
+    float z_dx,
+    const SpanShade *s,
+    const int features)
+{
+    // Without a gather, texturing four lanes costs what four scalar pixels do
+    if (features & SPAN_TEXTURE)
+        return span_scalar_body(color, depth, count, w, a, z, z_dx, s, features);
+
+    int32_t a0 = (int32_t)a[0], a1 = (int32_t)a[1], a2 = (int32_t)a[2];
+    __m128i step0 = _mm_setr_epi32(0, a0, 2*a0, 3*a0);
+    __m128i step1 = _mm_setr_epi32(0, a1, 2*a1, 3*a1);
+    __m128i step2 = _mm_setr_epi32(0, a2, 2*a2, 3*a2);
+    __m128 zstep = _mm_setr_ps(0.0f, z_dx, 2.0f*z_dx, 3.0f*z_dx);
+    __m128i neg_one = _mm_set1_epi32(-1);
+    __m128i cv = _mm_set1_epi32((int)s->color);
+
+    int32_t dr = s->dx[0], dg = s->dx[1], db = s->dx[2], df = s->dx[3];
+    __m128i rstep = _mm_setr_epi32(0, dr, 2*dr, 3*dr);
+    __m128i gstep = _mm_setr_epi32(0, dg, 2*dg, 3*dg);
+    __m128i bstep = _mm_setr_epi32(0, db, 2*db, 3*db);
+    __m128i fstep = _mm_setr_epi32(0, df, 2*df, 3*df);
+    __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    __m128i rmask = _mm_set1_epi32(0xFF0000);
+    __m128i gmask = _mm_set1_epi32(0xFF00);
+
+    int64_t w0 = w[0], w1 = w[1], w2 = w[2];
+    int32_t r = s->v[0], g = s->v[1], b = s->v[2], f = s->v[3];
+    int written = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i e0 = _mm_add_epi32(_mm_set1_epi32(span_sat(w0)), step0);
+        __m128i e1 = _mm_add_epi32(_mm_set1_epi32(span_sat(w1)), step1);
+        __m128i e2 = _mm_add_epi32(_mm_set1_epi32(span_sat(w2)), step2);
+        __m128i mask = _mm_cmpgt_epi32(_mm_or_si128(_mm_or_si128(e0, e1), e2), neg_one);
+
+        if (_mm_movemask_epi8(mask))
+        {
+            __m128 zv = _mm_setzero_ps();
+            __m128 dv = _mm_setzero_ps();
+            if (features & SPAN_DEPTH_TEST)
+            {
+                zv = _mm_add_ps(_mm_set1_ps(z), zstep);
+                dv = _mm_loadu_ps(depth + i);
+                mask = _mm_and_si128(mask, _mm_castps_si128(_mm_cmplt_ps(zv, dv)));
+            }
+            if (_mm_movemask_epi8(mask))
+            {
+                __m128i c = cv;
+                if (features & SPAN_SMOOTH)
+                {
+                    __m128i rv = _mm_add_epi32(_mm_set1_epi32(r), rstep);
+                    __m128i gv = _mm_add_epi32(_mm_set1_epi32(g), gstep);
+                    __m128i bv = _mm_add_epi32(_mm_set1_epi32(b), bstep);
+                    c = _mm_or_si128(_mm_or_si128(alpha, _mm_and_si128(rv, rmask)),
+                        _mm_or_si128(_mm_and_si128(_mm_srli_epi32(gv, 8), gmask), _mm_srli_epi32(bv, 16)));
+                }
+                if (features & SPAN_FOG)
+                    c = span_fog_sse2(c, _mm_add_epi32(_mm_set1_epi32(f), fstep));
+
+                __m128 mf = _mm_castsi128_ps(mask);
+                written += __builtin_popcount(_mm_movemask_ps(mf));
+                if (features & SPAN_DEPTH_TEST)
+                    _mm_storeu_ps(depth + i, _mm_or_ps(_mm_and_ps(mf, zv), _mm_andnot_ps(mf, dv)));
+                __m128i old = _mm_loadu_si128((__m128i *)(color + i));
+                _mm_storeu_si128((__m128i *)(color + i),
+                    _mm_or_si128(_mm_and_si128(mask, c), _mm_andnot_si128(mask, old)));
+            }
+        }
+        w0 += 4 * a[0];
+        w1 += 4 * a[1];
+        w2 += 4 * a[2];
+        z += 4.0f * z_dx;
+        if (features & SPAN_SMOOTH)
+        {
+            r += 4 * dr;
+            g += 4 * dg;
+            b += 4 * db;
+        }
+        if (features & SPAN_FOG) f += 4 * df;
+    }
+
+    if (i < count)
+    {
+        int64_t rest[3] = { w0, w1, w2 };
+        SpanShade tail = *s;
+        tail.v[0] = r;
+        tail.v[1] = g;
+        tail.v[2] = b;
+        tail.v[3] = f;
+        written += span_scalar_body(color + i, depth + i, count - i, rest, a, z, z_dx, &tail, features);
+    }
+    return written;
+}
+
+__attribute__((target("avx2")))
+SPAN_TEMPLATE __m256i span_fog_avx2(__m256i c, __m256i f)
+{
+    __m256i index = _mm256_srai_epi32(f, 16);
+    index = _mm256_max_epi32(index, _mm256_setzero_si256());
+    index = _mm256_min_epi32(index, _mm256_set1_epi32(FOG_LUT_SIZE - 1));
+    __m256i k = _mm256_i32gather_epi32(g_fog_lut, index, 4);
+    __m256i inv = _mm256_sub_epi32(_mm256_set1_epi32(256), k);
+    __m256i byte = _mm256_set1_epi32(0xFF);
+
+    // 16-bit multiplies as in span_fog_sse2; they are cheaper than 32-bit ones
+    __m256i r = _mm256_and_si256(_mm256_srli_epi32(c, 16), byte);
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(c, 8), byte);
+    __m256i b = _mm256_and_si256(c, byte);
+    r = _mm256_add_epi32(_mm256_mullo_epi16(r, inv), _mm256_mullo_epi16(_mm256_set1_epi32((g_fog_color >> 16) & 0xFF), k));
+    g = _mm256_add_epi32(_mm256_mullo_epi16(g, inv), _mm256_mullo_epi16(_mm256_set1_epi32((g_fog_color >> 8) & 0xFF), k));
+    b = _mm256_add_epi32(_mm256_mullo_epi16(b, inv), _mm256_mullo_epi16(_mm256_set1_epi32(g_fog_color & 0xFF), k));
+
+    return _mm256_or_si256(_mm256_or_si256(_mm256_set1_epi32((int)0xFF000000), _mm256_slli_epi32(_mm256_srli_epi32(r, 8), 16)),
+        _mm256_or_si256(_mm256_and_si256(g, _mm256_set1_epi32(0xFF00)), _mm256_srli_epi32(b, 8)));
+}
+
+// Nearest texels at (u, v), eight at a time; masking the coordinates keeps
+// every lane's index inside the level, covered or not
+__attribute__((target("avx2")))
+SPAN_TEMPLATE __m256i span_texel_avx2(const SpanShade *s, __m256 u, __m256 v)
+{
+    __m256 wrap = _mm256_set1_ps(SPAN_TEXTURE_WRAP);
+    __m256i three = _mm256_set1_epi32(3);
+    __m256i tx = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_add_ps(u, wrap)), _mm256_set1_epi32(s->tex_w_mask));
+    __m256i ty = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_add_ps(v, wrap)), _mm256_set1_epi32(s->tex_h_mask));
+    __m256i block = _mm256_add_epi32(
+        _mm256_sll_epi32(_mm256_srli_epi32(ty, 2), _mm_cvtsi32_si128(s->tex_w_log2 - 2)),
+        _mm256_srli_epi32(tx, 2));
+    __m256i index = _mm256_or_si256(_mm256_slli_epi32(block, 4),
+        _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(ty, three), 2), _mm256_and_si256(tx, three)));
+    return _mm256_i32gather_epi32((const int *)s->texels, index, 4);
+}
+
+// texture_modulate on eight lanes; the products fit 16 bits as in fog
+__attribute__((target("avx2")))
+SPAN_TEMPLATE __m256i span_modulate_avx2(__m256i tex, __m256i c)
+{
+    __m256i byte = _mm256_set1_epi32(0xFF);
+    __m256i one = _mm256_set1_epi32(1);
+    __m256i r = _mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi32(tex, 16), byte),
+        _mm256_add_epi32(_mm256_and_si256(_mm256_srli_epi32(c, 16), byte), one));
+    __m256i g = _mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi32(tex, 8), byte),
+        _mm256_add_epi32(_mm256_and_si256(_mm256_srli_epi32(c, 8), byte), one));
+    __m256i b = _mm256_mullo_epi16(_mm256_and_si256(tex, byte),
+        _mm256_add_epi32(_mm256_and_si256(c, byte), one));
+
+    return _mm256_or_si256(_mm256_or_si256(_mm256_set1_epi32((int)0xFF000000), _mm256_slli_epi32(_mm256_srli_epi32(r, 8), 16)),
+        _mm256_or_si256(_mm256_and_si256(g, _mm256_set1_epi32(0xFF00)), _mm256_srli_epi32(b, 8)));
+}
+
+__attribute__((target("avx2")))
+SPAN_TEMPLATE int span_avx2_body(
+    uint32_t *color,
+    float *depth,
+    int count,
+    const int64_t w[3],
+    const int64_t a[3],
+    float z,
+    float z_dx,
+    const SpanShade *s,
+    const int features)
+{
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i step0 = _mm256_mullo_epi32(_mm256_set1_epi32((int32_t)a[0]), lanes);
+    __m256i step1 = _mm256_mullo_epi32(_mm256_set1_epi32((int32_t)a[1]), lanes);
+    __m256i step2 = _mm256_mullo_epi32(_mm256_set1_epi32((int32_t)a[2]), lanes);
+    __m256 zstep = _mm256_mul_ps(_mm256_set1_ps(z_dx), _mm256_cvtepi32_ps(lanes));
+    __m256i neg_one = _mm256_set1_epi32(-1);
+    __m256i cv = _mm256_set1_epi32((int)s->color);
+
+    __m256i rstep = _mm256_mullo_epi32(_mm256_set1_epi32(s->dx[0]), lanes);
+    __m256i gstep = _mm256_mullo_epi32(_mm256_set1_epi32(s->dx[1]), lanes);
+    __m256i bstep = _mm256_mullo_epi32(_mm256_set1_epi32(s->dx[2]), lanes);
+    __m256i fstep = _mm256_mullo_epi32(_mm256_set1_epi32(s->dx[3]), lanes);
+    __m256 lanes_ps = _mm256_cvtepi32_ps(lanes);
+    __m256 qstep = _mm256_mul_ps(_mm256_set1_ps(s->tq_dx[0]), lanes_ps);
+    __m256 ustep = _mm256_mul_ps(_mm256_set1_ps(s->tq_dx[1]), lanes_ps);
+    __m256 vstep = _mm256_mul_ps(_mm256_set1_ps(s->tq_dx[2]), lanes_ps);
+    __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+    __m256i rmask = _mm256_set1_epi32(0xFF0000);
+    __m256i gmask = _mm256_set1_epi32(0xFF00);
+
+    int64_t w0 = w[0], w1 = w[1], w2 = w[2];
+    int32_t r = s->v[0], g = s->v[1], b = s->v[2], f = s->v[3];
+    float q = s->tq[0], tu = s->tq[1], tv = s->tq[2];
+    int written = 0;
+    for (int i = 0; i < count; i += 8)
+    {
+        // The tail block only loads and stores the lanes inside the span
+        __m256i live = _mm256_cmpgt_epi32(_mm256_set1_epi32(count - i), lanes);
+
+        __m256i e0 = _mm256_add_epi32(_mm256_set1_epi32(span_sat(w0)), step0);
+        __m256i e1 = _mm256_add_epi32(_mm256_set1_epi32(span_sat(w1)), step1);
+        __m256i e2 = _mm256_add_epi32(_mm256_set1_epi32(span_sat(w2)), step2);
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_or_si256(_mm256_or_si256(e0, e1), e2), neg_one);
+        mask = _mm256_and_si256(mask, live);
+
+        if (!_mm256_testz_si256(mask, mask))
+        {
+            __m256 zv = _mm256_setzero_ps();
+            if (features & SPAN_DEPTH_TEST)
+            {
+                zv = _mm256_add_ps(_mm256_set1_ps(z), zstep);
+                __m256 dv = _mm256_maskload_ps(depth + i, mask);
+                mask = _mm256_and_si256(mask, _mm256_castps_si256(_mm256_cmp_ps(zv, dv, _CMP_LT_OQ)));
+            }
+            if (!_mm256_testz_si256(mask, mask))
+            {
+                __m256i c = cv;
+                if (features & SPAN_SMOOTH)
+                {
+                    __m256i rv = _mm256_add_epi32(_mm256_set1_epi32(r), rstep);
+                    __m256i gv = _mm256_add_epi32(_mm256_set1_epi32(g), gstep);
+                    __m256i bv = _mm256_add_epi32(_mm256_set1_epi32(b), bstep);
+                    c = _mm256_or_si256(_mm256_or_si256(alpha, _mm256_and_si256(rv, rmask)),
+                        _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(gv, 8), gmask), _mm256_srli_epi32(bv, 16)));
+                }
+                if (features & SPAN_TEXTURE)
+                {
+                    __m256 inv = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_add_ps(_mm256_set1_ps(q), qstep));
+                    __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(tu), ustep), inv);
+                    __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(tv), vstep), inv);
+                    c = span_modulate_avx2(span_texel_avx2(s, u, v), c);
+                }
+                if (features & SPAN_FOG)
+                    c = span_fog_avx2(c, _mm256_add_epi32(_mm256_set1_epi32(f), fstep));
+
+                if (features & SPAN_DEPTH_TEST) _mm256_maskstore_ps(depth + i, mask, zv);
+                _mm256_maskstore_epi32((int *)(color + i), mask, c);
+                written += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(mask)));
+            }
+        }
+        w0 += 8 * a[0];
+        w1 += 8 * a[1];
+        w2 += 8 * a[2];
+        z += 8.0f * z_dx;
+        if (features & SPAN_SMOOTH)
+        {
+            r += 8 * s->dx[0];
+            g += 8 * s->dx[1];
+            b += 8 * s->dx[2];
+        }
+        if (features & SPAN_FOG) f += 8 * s->dx[3];
+        if (features & SPAN_TEXTURE)
+        {
+            q += 8.0f * s->tq_dx[0];
+            tu += 8.0f * s->tq_dx[1];
+            tv += 8.0f * s->tq_dx[2];
+        }
+    }
+    return written;
+}
+
+#endif // SPAN_X86
+
+// One kernel per feature combination and instruction set, named by the
+// feature bits, e.g. span_avx2_3 is depth tested and smooth without fog or
+// texture; g_span_<isa>[features] is the table the rasterizer dispatches
+// through
+#define SPAN_INSTANCE(target, isa, features) \
+    target static int span_##isa##_##features( \
+        uint32_t *color, float *depth, int count, const int64_t w[3], \
+        const int64_t a[3], float z, float z_dx, const SpanShade *s) \
+    { \
+        return span_##isa##_body(color, depth, count, w, a, z, z_dx, s, features); \
+    }
+
+#define SPAN_INSTANCES(target, isa) \
+    SPAN_INSTANCE(target, isa, 0) \
+    SPAN_INSTANCE(target, isa, 1) \
+    SPAN_INSTANCE(target, isa, 2) \
+    SPAN_INSTANCE(target, isa, 3) \
+    SPAN_INSTANCE(target, isa, 4) \
+    SPAN_INSTANCE(target, isa, 5) \
+    SPAN_INSTANCE(target, isa, 6) \
+    SPAN_INSTANCE(target, isa, 7) \
+    SPAN_INSTANCE(target, isa, 8) \
+    SPAN_INSTANCE(target, isa, 9) \
+    SPAN_INSTANCE(target, isa, 10) \
+    SPAN_INSTANCE(target, isa, 11) \
+    SPAN_INSTANCE(target, isa, 12) \
+    SPAN_INSTANCE(target, isa, 13) \
+    SPAN_INSTANCE(target, isa, 14) \
+    SPAN_INSTANCE(target, isa, 15) \
+    static const SpanKernel g_span_##isa[SPAN_VARIANTS] = { \
+        span_##isa##_0, span_##isa##_1, span_##isa##_2, span_##isa##_3, \
+        span_##isa##_4, span_##isa##_5, span_##isa##_6, span_##isa##_7, \
+        span_##isa##_8, span_##isa##_9, span_##isa##_10, span_##isa##_11, \
+        span_##isa##_12, span_##isa##_13, span_##isa##_14, span_##isa##_15 \
+    };
+
+SPAN_INSTANCES(, scalar)
+#ifdef SPAN_X86
+SPAN_INSTANCES(__attribute__((target("sse2"))), sse2)
+SPAN_INSTANCES(__attribute__((target("avx2"))), avx2)
+#endif
+
+// The widest kernel table the CPU runs
+static inline const SpanKernel *span_select(void)
+{
+#ifdef SPAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        printf("[LOG] Span kernel: avx2\n");
+        return g_span_avx2;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        printf("[LOG] Span kernel: sse2\n");
+        return g_span_sse2;
+    }
+#endif
+    printf("[LOG] Span kernel: scalar\n");
+    return g_span_scalar;
+}
+
+#endif // SPAN_H
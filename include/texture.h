@@ -0,0 +1,224 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include <string.h>
+#include "game.h"
+
+// Largest side, so texel coordinates of a repeat fit 16.16 fixed point
+#define TEXTURE_MAX_LOG2 12
+
+// Index of texel (x, y) within a level 1 << w_log2 texels wide
+static inline int texture_texel_index(int w_log2, int x, int y)
+{
+    return ((((y >> 2) << (w_log2 - 2)) + (x >> 2)) << 4) | ((y & 3) << 2) | (x & 3);
+}
+
+static inline int texture_log2(int v)
+{
+    int l = 0;
+    while ((1 << (l + 1)) <= v) l++;
+    return l;
+}
+
+// Builds t from w x h pixels, row by row: the largest power-of-two size
+// that fits (nearest texels when it has to shrink), then each mip level
+// by averaging 2x2 texels of the one above
+static inline int texture_create(Texture *t, const char *name, int w, int h, const uint32_t *pixels)
+{
+    *t = (Texture){0};
+    if (w < TEXTURE_BLOCK || h < TEXTURE_BLOCK) return 0;
+    snprintf(t->name, sizeof(t->name), "%s", name);
+    t->w_log2 = texture_log2(w);
+    t->h_log2 = texture_log2(h);
+    if (t->w_log2 > TEXTURE_MAX_LOG2) t->w_log2 = TEXTURE_MAX_LOG2;
+    if (t->h_log2 > TEXTURE_MAX_LOG2) t->h_log2 = TEXTURE_MAX_LOG2;
+
+    int total = 0;
+    for (int l = 0; l < TEXTURE_MAX_LEVELS && t->w_log2 - l >= 2 && t->h_log2 - l >= 2; l++)
+    {
+        t->offset[l] = total;
+        total += 1 << (t->w_log2 - l + t->h_log2 - l);
+        t->levels++;
+    }
+    t->texels = (uint32_t *)malloc(sizeof(uint32_t) * total);
+
+    int tw = 1 << t->w_log2, th = 1 << t->h_log2;
+    for (int y = 0; y < th; y++)
+        for (int x = 0; x < tw; x++)
+            t->texels[texture_texel_index(t->w_log2, x, y)] = pixels[(y * h / th) * w + x * w / tw] | 0xFF000000;
+
+    for (int l = 1; l < t->levels; l++)
+    {
+        const uint32_t *src = t->texels + t->offset[l - 1];
+        uint32_t *dst = t->texels + t->offset[l];
+        int src_log2 = t->w_log2 - l + 1, dst_log2 = t->w_log2 - l;
+        for (int y = 0; y < th >> l; y++)
+        {
+            for (int x = 0; x < tw >> l; x++)
+            {
+                uint32_t c[4] = {
+                    src[texture_texel_index(src_log2, 2 * x, 2 * y)],
+                    src[texture_texel_index(src_log2, 2 * x + 1, 2 * y)],
+                    src[texture_texel_index(src_log2, 2 * x, 2 * y + 1)],
+                    src[texture_texel_index(src_log2, 2 * x + 1, 2 * y + 1)]
+                };
+                uint32_t rb = 0, g = 0;
+                for (int i = 0; i < 4; i++)
+                {
+                    rb += c[i] & 0xFF00FFu;
+                    g += c[i] & 0xFF00u;
+                }
+                dst[texture_texel_index(dst_log2, x, y)] = 0xFF000000u | (((rb + 0x20002u) >> 2) & 0xFF00FFu) | (((g + 0x200u) >> 2) & 0xFF00u);
+            }
+        }
+    }
+    return 1;
+}
+
+// Texel tex scaled per channel by c, 255 leaving it as is
+static inline uint32_t texture_modulate(uint32_t tex, uint32_t c)
+{
+    uint32_t r = ((tex >> 16) & 0xFF) * (((c >> 16) & 0xFF) + 1) >> 8;
+    uint32_t g = ((tex >> 8) & 0xFF) * (((c >> 8) & 0xFF) + 1) >> 8;
+    uint32_t b = (tex & 0xFF) * ((c & 0xFF) + 1) >> 8;
+    return 0xFF000000u | (r << 16) | (g << 8) | b;
+}
+
+static inline void texture_free(Texture *t)
+{
+    free(t->texels);
+    *t = (Texture){0};
+}
+
+// Mip level for a footprint of rho level-0 texels per pixel
+static inline int texture_lod(const Texture *t, float rho)
+{
+    int lod = 0;
+    while (rho >= 2.0f && lod < t->levels - 1)
+    {
+        rho *= 0.5f;
+        lod++;
+    }
+    return lod;
+}
+
+// Binary PPM (P6, 8 bits per channel) as 0xAARRGGBB pixels
+static inline uint32_t *texture_load_ppm(const char *path, int *w, int *h)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+
+    int max = 0;
+    char magic[3] = {0};
+    uint32_t *pixels = NULL;
+    if (fscanf(f, "%2s", magic) == 1 && strcmp(magic, "P6") == 0)
+    {
+        // Header fields may be separated by comment lines
+        int fields[3], n = 0;
+        while (n < 3)
+        {
+            int ch = fgetc(f);
+            if (ch == EOF) break;
+            if (ch == '#')
+            {
+                while (ch != '\n' && ch != EOF) ch = fgetc(f);
+                continue;
+            }
+            if (ch < '0' || ch > '9') continue;
+            ungetc(ch, f);
+            if (fscanf(f, "%d", &fields[n]) != 1) break;
+            n++;
+        }
+        fgetc(f);
+        if (n == 3) { *w = fields[0]; *h = fields[1]; max = fields[2]; }
+    }
+    if (max == 255 && *w > 0 && *h > 0 && *w <= 16384 && *h <= 16384)
+    {
+        int count = *w * *h;
+        uint8_t *rgb = (uint8_t *)malloc(3 * (size_t)count);
+        if (fread(rgb, 3, count, f) == (size_t)count)
+        {
+            pixels = (uint32_t *)malloc(sizeof(uint32_t) * count);
+            for (int i = 0; i < count; i++)
+                pixels[i] = 0xFF000000u | (rgb[3 * i] << 16) | (rgb[3 * i + 1] << 8) | rgb[3 * i + 2];
+        }
+        free(rgb);
+    }
+    fclose(f);
+    return pixels;
+}
+
+static inline uint32_t texture_hash(uint32_t x, uint32_t y, uint32_t seed)
+{
+    uint32_t h = x * 374761393u + y * 668265263u + seed * 2246822519u;
+    h = (h ^ (h >> 13)) * 1274126177u;
+    return h ^ (h >> 16);
+}
+
+// c with each channel scaled by k / 256
+static inline uint32_t texture_shade(uint32_t c, int k)
+{
+    int r = ((c >> 16) & 0xFF) * k >> 8, g = ((c >> 8) & 0xFF) * k >> 8, b = (c & 0xFF) * k >> 8;
+    r = r > 255 ? 255 : r;
+    g = g > 255 ? 255 : g;
+    b = b > 255 ? 255 : b;
+    return 0xFF000000u | (r << 16) | (g << 8) | b;
+}
+
+// Built-in textures by name, so levels look right without image files:
+// bricks, planks, stone and tiles, 64x64. Returns NULL for other names.
+#define TEXTURE_BUILTIN_SIZE 64
+
+static inline uint32_t *texture_builtin(const char *name)
+{
+    const int n = TEXTURE_BUILTIN_SIZE;
+    int kind = strcmp(name, "bricks") == 0 ? 1
+        : strcmp(name, "planks") == 0 ? 2
+        : strcmp(name, "stone") == 0 ? 3
+        : strcmp(name, "tiles") == 0 ? 4 : 0;
+    if (!kind) return NULL;
+
+    uint32_t *pixels = (uint32_t *)malloc(sizeof(uint32_t) * n * n);
+    for (int y = 0; y < n; y++)
+    {
+        for (int x = 0; x < n; x++)
+        {
+            int grain = 224 + (int)(texture_hash(x, y, kind) & 31);
+            uint32_t c;
+            if (kind == 1)
+            {
+                // 32x16 bricks, every other row offset by half a brick
+                int row = y / 16;
+                int bx = (x + (row & 1) * 16) % n;
+                int brick = bx / 32;
+                if (y % 16 < 2 || bx % 32 < 2) c = texture_shade(0xFFB8B0A8, grain);
+                else c = texture_shade(0xFFA4503C, grain - 24 + (int)(texture_hash(brick, row, 7) & 63));
+            }
+            else if (kind == 2)
+            {
+                // 16 texel wide planks with grain running down them
+                int plank = x / 16;
+                int streak = (int)(texture_hash(x, y / 8 + plank * 31, 3) & 15);
+                if (x % 16 == 0) c = 0xFF4A3020;
+                else c = texture_shade(0xFF9C6A40, 216 + streak + (int)(texture_hash(plank, 0, 5) & 31));
+            }
+            else if (kind == 3)
+            {
+                // Blocky value noise at three scales
+                int v = (int)(texture_hash(x / 16, y / 16, 11) & 63) + (int)(texture_hash(x / 4, y / 4, 13) & 31)
+                    + (int)(texture_hash(x, y, 17) & 15);
+                c = texture_shade(0xFFA8A8A0, 176 + v);
+            }
+            else
+            {
+                // 4x4 square tiles with thin grout
+                if (x % 16 == 0 || y % 16 == 0) c = 0xFF909090;
+                else c = texture_shade(0xFFF0F0E8, grain + (int)(texture_hash(x / 16, y / 16, 19) & 15) - 16);
+            }
+            pixels[y * n + x] = c;
+        }
+    }
+    return pixels;
+}
+
+#endif // TEXTURE_H
@@ -2,140 +2,237 @@
 #define TRIANGLE_H
 
 #include "util.h"
+#include "raster.h"
+#include "clip.h"
+#include "lights.h"
 
-static inline int triangle_behind_camera(Vec3 tri[3], Camera cam)
+// A lit camera-space vertex, fogged here in vertex mode; fog is also
+// returned as a fog table coordinate for the per-pixel mode
+static inline void shade_vertex(ShadeMode mode, Vec3 cam, uint32_t lit, uint32_t *color, float *fog)
 {
-    for (int i = 0; i < 3; i++)
+    float dist = sqrtf(vec3_dot(cam, cam));
+    *color = (mode == SHADE_PIXEL) ? lit : apply_fog(lit, dist);
+    *fog = dist * FOG_LUT_SCALE;
+}
+
+// Baked vertex colors interpolated to p, a point of the camera-space triangle
+static inline uint32_t baked_color_at(const Vec3 cam_tri[3], const uint32_t baked[3], Vec3 p)
+{
+    Vec3 n = vec3_cross(vec3_sub(cam_tri[1], cam_tri[0]), vec3_sub(cam_tri[2], cam_tri[0]));
+    float inv = 1.0f / vec3_dot(n, n);
+    float w0 = vec3_dot(vec3_cross(vec3_sub(cam_tri[2], cam_tri[1]), vec3_sub(p, cam_tri[1])), n) * inv;
+    float w1 = vec3_dot(vec3_cross(vec3_sub(cam_tri[0], cam_tri[2]), vec3_sub(p, cam_tri[2])), n) * inv;
+    return color_blend3(baked, w0, w1, 1.0f - w0 - w1);
+}
+
+// Texture coordinates on a textured quad: u along its horizontal edge and
+// v down its vertical one from the top, in repeats of TEXTURE_REPEAT world
+// units, so neighbouring walls of one height line up
+#define TEXTURE_REPEAT 100.0f
+
+typedef struct
+{
+    const Texture *texture;
+    Vec3 origin;
+    Vec3 u;
+    Vec3 v;
+}
+TexMap;
+
+// verts in the winding rect_corners gives
+static inline TexMap texmap_quad(const Texture *texture, const Vec3 verts[4])
+{
+    Vec3 e1 = vec3_sub(verts[1], verts[0]);
+    Vec3 e2 = vec3_sub(verts[3], verts[0]);
+    if (fabsf(e1.y) > fabsf(e2.y))
+    {
+        Vec3 tmp = e1;
+        e1 = e2;
+        e2 = tmp;
+    }
+    TexMap map = { texture, verts[0], vec3_normalize(e1), vec3_normalize(e2) };
+    if (e2.y > 0.0f)
     {
-        Vec3 rel = { tri[i].x - cam.pos_x, tri[i].y - cam.pos_y, tri[i].z - cam.pos_z };
-        
-        float cos_x = cosf(cam.angle_x);
-        float sin_x = sinf(cam.angle_x);
-        float cos_y = cosf(cam.angle_y);
-        float sin_y = sinf(cam.angle_y);
-
-        float tmp_x = rel.x * cos_x - rel.z * sin_x;
-        float tmp_z = rel.x * sin_x + rel.z * cos_x;
-        rel.x = tmp_x;
-        rel.z = tmp_z;
-
-        float tmp_y = rel.y * cos_y - rel.z * sin_y;
-        tmp_z = rel.y * sin_y + rel.z * cos_y;
-        rel.y = tmp_y;
-        rel.z = tmp_z;
-
-        // If any vertex is behind or at camera, reject triangle
-        if (rel.z <= Z_NEAR * 0.5f) return 1;
+        map.origin = vec3_add(verts[0], e2);
+        map.v = vec3_scale(map.v, -1.0f);
     }
-    return 0;
+    map.u = vec3_scale(map.u, 1.0f / TEXTURE_REPEAT);
+    map.v = vec3_scale(map.v, 1.0f / TEXTURE_REPEAT);
+    return map;
 }
 
-static inline void place_triangle( buffer *buf, Olivec_Canvas oc, Vec3 tri[3], uint32_t c, Light light, Camera cam)
+static inline Vec2 texmap_uv(const TexMap *map, Vec3 world)
 {
-    if (is_back_facing(tri, cam)) return;
-    if (triangle_behind_camera(tri, cam)) return;
+    Vec3 d = vec3_sub(world, map->origin);
+    return (Vec2){ vec3_dot(d, map->u), vec3_dot(d, map->v) };
+}
+
+// Shaded modes: the clipped polygon is shaded per vertex and fanned out.
+// baked, when not NULL, holds the lit colors of the three corners. Textured
+// triangles come here in every mode: their fog has to go over the texel, so
+// it is always looked up per pixel.
+static inline void place_triangle_shaded(Raster *rs, Vec3 cam_tri[3], int clip_mask, Vec3 normal, uint32_t c, Light light, const View *view, const uint32_t *baked, const LightList *lights, const TexMap *tex)
+{
+    Polygon poly = { { cam_tri[0], cam_tri[1], cam_tri[2] }, 3 };
+    if (clip_mask) polygon_clip_planes(&poly, view->clip, clip_mask);
+    if (poly.num_vertices < 3) return;
 
-    Vec3 normal = calculate_triangle_normal(tri);
+    Vec3 projected[MAX_POLY_VERTS];
+    uint32_t colors[MAX_POLY_VERTS];
+    float fog[MAX_POLY_VERTS];
+    Vec2 uv[MAX_POLY_VERTS];
+    ShadeMode mode = tex ? SHADE_PIXEL : rs->shade;
+    for (int i = 0; i < poly.num_vertices; i++)
+    {
+        projected[i] = project(poly.vertices[i], view);
+        uint32_t lit;
+        if (!baked) lit = apply_lighting(c, normal, view_to_world(view, poly.vertices[i]), light);
+        else if (!clip_mask) lit = baked[i];
+        else lit = baked_color_at(cam_tri, baked, poly.vertices[i]);
+        if (lights) lit = lights_shade(lit, c, normal, view_to_world(view, poly.vertices[i]), *lights);
+        shade_vertex(mode, poly.vertices[i], lit, &colors[i], &fog[i]);
+        if (tex) uv[i] = texmap_uv(tex, view_to_world(view, poly.vertices[i]));
+    }
+
+    for (int i = 1; i + 1 < poly.num_vertices; i++)
+    {
+        Vec3 screen[3] = { projected[0], projected[i], projected[i + 1] };
+        uint32_t tri_colors[3] = { colors[0], colors[i], colors[i + 1] };
+        float tri_fog[3] = { fog[0], fog[i], fog[i + 1] };
+        if (tex)
+        {
+            Vec2 tri_uv[3] = { uv[0], uv[i], uv[i + 1] };
+            raster_submit_textured(rs, screen, tri_colors, tri_fog, tri_uv, tex->texture);
+        }
+        else raster_submit_shaded(rs, screen, tri_colors, tri_fog);
+    }
+}
+
+// baked, when not NULL, holds the lit colors of the corners and the center;
+// lights, when not NULL, are the point lights reaching the triangle; tex,
+// when not NULL, textures it
+static inline void place_triangle(Raster *rs, Vec3 tri[3], Vec3 cam_tri[3], Vec3 normal, uint32_t c, Light light, const View *view, const uint32_t *baked, const LightList *lights, const TexMap *tex)
+{
+    if (vec3_dot(normal, vec3_sub(view->eye, tri[0])) <= 0.0f) return;
+
+    int codes[3];
+    for (int i = 0; i < 3; i++)
+        codes[i] = clip_outcode(view->clip, VIEW_CLIP_PLANES, cam_tri[i]);
+    if (codes[0] & codes[1] & codes[2]) return;
+
+    if (rs->shade != SHADE_FLAT || tex)
+    {
+        place_triangle_shaded(rs, cam_tri, codes[0] | codes[1] | codes[2], normal, c, light, view, baked, lights, tex);
+        return;
+    }
+
+    Vec3 cam_center = {
+        (cam_tri[0].x + cam_tri[1].x + cam_tri[2].x) / 3.0f,
+        (cam_tri[0].y + cam_tri[1].y + cam_tri[2].y) / 3.0f,
+        (cam_tri[0].z + cam_tri[1].z + cam_tri[2].z) / 3.0f
+    };
+
+    // Flat shaded: lighting and fog only depend on the triangle center
     Vec3 center = {
         (tri[0].x + tri[1].x + tri[2].x) / 3.0f,
         (tri[0].y + tri[1].y + tri[2].y) / 3.0f,
         (tri[0].z + tri[1].z + tri[2].z) / 3.0f
     };
-
-    uint32_t lit_color = apply_lighting(c, normal, center, light);
+    uint32_t lit_color = baked ? baked[3] : apply_lighting(c, normal, center, light);
+    if (lights) lit_color = lights_shade(lit_color, c, normal, center, *lights);
+    float dist = sqrtf(vec3_dot(cam_center, cam_center));
+    uint32_t fog_color_val = apply_fog(lit_color, dist);
 
     Vec3 screen[3];
-    float cam_z[3];
-    for (int i = 0; i < 3; i++)
+    int clip_mask = codes[0] | codes[1] | codes[2];
+    if (!clip_mask)
     {
-        screen[i] = project(tri[i], cam, buf->w, buf->h);
-        cam_z[i] = tri[i].z - cam.pos_z;
+        for (int i = 0; i < 3; i++)
+            screen[i] = project(cam_tri[i], view);
+        raster_submit(rs, screen, fog_color_val);
+        return;
     }
 
-    int minX = fmaxf(0, floorf(fminf(screen[0].x, fminf(screen[1].x, screen[2].x))));
-    int minY = fmaxf(0, floorf(fminf(screen[0].y, fminf(screen[1].y, screen[2].y))));
-    int maxX = fminf(buf->w - 1, ceilf(fmaxf(screen[0].x, fmaxf(screen[1].x, screen[2].x))));
-    int maxY = fminf(buf->h - 1, ceilf(fmaxf(screen[0].y, fmaxf(screen[1].y, screen[2].y))));
+    // Crosses the near plane or the guard band: clip and fan out the result
+    Polygon poly = { { cam_tri[0], cam_tri[1], cam_tri[2] }, 3 };
+    polygon_clip_planes(&poly, view->clip, clip_mask);
+    if (poly.num_vertices < 3) return;
 
-    float denom = ((screen[1].y - screen[2].y)*(screen[0].x - screen[2].x) +
-                   (screen[2].x - screen[1].x)*(screen[0].y - screen[2].y));
-    if (fabsf(denom) < 1e-6f) return;
+    Vec3 projected[MAX_POLY_VERTS];
+    for (int i = 0; i < poly.num_vertices; i++)
+        projected[i] = project(poly.vertices[i], view);
 
-    for (int y = minY; y <= maxY; y++)
+    for (int i = 1; i + 1 < poly.num_vertices; i++)
     {
-        for (int x = minX; x <= maxX; x++)
-        {
-            float alpha = ((screen[1].y - screen[2].y)*(x - screen[2].x) +
-                           (screen[2].x - screen[1].x)*(y - screen[2].y)) / denom;
-            float beta = ((screen[2].y - screen[0].y)*(x - screen[2].x) +
-                          (screen[0].x - screen[2].x)*(y - screen[2].y)) / denom;
-            float gamma = 1.0f - alpha - beta;
-
-            if (alpha >= 0 && beta >= 0 && gamma >= 0)
-            {
-                float z =
-                    alpha * screen[0].z + beta * screen[1].z + gamma * screen[2].z;
-
-                float dist = distance_from_camera(center, cam);
-                uint32_t fog_color_val = apply_fog(lit_color, dist);
-
-                put_pixel_depth(buf, x, y, z, fog_color_val);
-            }
-        }
+        screen[0] = projected[0];
+        screen[1] = projected[i];
+        screen[2] = projected[i + 1];
+        raster_submit(rs, screen, fog_color_val);
     }
 }
 
-static inline void place_rect_help( buffer *buf, Olivec_Canvas oc, Vec3 v0, Vec3 v1, Vec3 v2, Vec3 v3, uint32_t c, Light light, Camera cam)
+// Both triangles of a quad share the plane, so one normal serves both.
+// baked, when not NULL, is the quad's LIGHTMAP_SAMPLES lit colors.
+static inline void place_rect_help(Raster *rs, Vec3 verts[4], Vec3 cam_verts[4], Vec3 normal, uint32_t c, Light light, const View *view, const uint32_t *baked, const LightList *lights, const TexMap *tex)
 {
     Vec3 center = {
-        (v0.x + v1.x + v2.x + v3.x) * 0.25f,
-        (v0.y + v1.y + v2.y + v3.y) * 0.25f,
-        (v0.z + v1.z + v2.z + v3.z) * 0.25f
+        (cam_verts[0].x + cam_verts[1].x + cam_verts[2].x + cam_verts[3].x) * 0.25f,
+        (cam_verts[0].y + cam_verts[1].y + cam_verts[2].y + cam_verts[3].y) * 0.25f,
+        (cam_verts[0].z + cam_verts[1].z + cam_verts[2].z + cam_verts[3].z) * 0.25f
     };
-    float dist_sq = (center.x - cam.pos_x) * (center.x - cam.pos_x) +
-                    (center.y - cam.pos_y) * (center.y - cam.pos_y) +
-                    (center.z - cam.pos_z) * (center.z - cam.pos_z);
+    float dist_sq = vec3_dot(center, center);
     if (dist_sq > g_fog_end * g_fog_end) return;
 
-    Vec3 tri1[3] = {v0, v1, v2};
-    Vec3 tri2[3] = {v0, v2, v3};
-    place_triangle(buf, oc, tri1, c, light, cam);
-    place_triangle(buf, oc, tri2, c, light, cam);
+    Vec3 tri1[3] = {verts[0], verts[1], verts[2]};
+    Vec3 tri2[3] = {verts[0], verts[2], verts[3]};
+    Vec3 cam_tri1[3] = {cam_verts[0], cam_verts[1], cam_verts[2]};
+    Vec3 cam_tri2[3] = {cam_verts[0], cam_verts[2], cam_verts[3]};
+    if (!baked)
+    {
+        place_triangle(rs, tri1, cam_tri1, normal, c, light, view, NULL, lights, tex);
+        place_triangle(rs, tri2, cam_tri2, normal, c, light, view, NULL, lights, tex);
+        return;
+    }
+    uint32_t baked1[4] = { baked[0], baked[1], baked[2], baked[4] };
+    uint32_t baked2[4] = { baked[0], baked[2], baked[3], baked[5] };
+    place_triangle(rs, tri1, cam_tri1, normal, c, light, view, baked1, lights, tex);
+    place_triangle(rs, tri2, cam_tri2, normal, c, light, view, baked2, lights, tex);
 }
 
-static inline void place_rect( buffer *buf, Olivec_Canvas oc, Vec3 pos, float size1, float size2, float angle, uint32_t c, RectType type, bool cull_other_side, Light light, Camera cam)
+// World-space corners of a rect, in the winding place_rect_help expects
+static inline void rect_corners(Vec3 pos, float size1, float size2, float angle, RectType type, bool cull_other_side, Vec3 verts[4])
 {
-    Vec3 v0, v1, v2, v3;
     switch (type)
     {
         case FLOOR:
-            v0 = (Vec3){0, 0, 0};
-            v1 = (Vec3){size1, 0, 0};
-            v2 = (Vec3){size1, 0, size2};
-            v3 = (Vec3){0, 0, size2};
+            verts[0] = (Vec3){0, 0, 0};
+            verts[1] = (Vec3){size1, 0, 0};
+            verts[2] = (Vec3){size1, 0, size2};
+            verts[3] = (Vec3){0, 0, size2};
             break;
         case WALL_X:
-            v0 = (Vec3){0, 0, 0};
-            v1 = (Vec3){0, 0, size1};
-            v2 = (Vec3){0, size2, size1};
-            v3 = (Vec3){0, size2, 0};
+            verts[0] = (Vec3){0, 0, 0};
+            verts[1] = (Vec3){0, 0, size1};
+            verts[2] = (Vec3){0, size2, size1};
+            verts[3] = (Vec3){0, size2, 0};
             break;
         case WALL_Z:
-            v0 = (Vec3){0, 0, 0};
-            v1 = (Vec3){size1, 0, 0};
-            v2 = (Vec3){size1, size2, 0};
-            v3 = (Vec3){0, size2, 0};
+            verts[0] = (Vec3){0, 0, 0};
+            verts[1] = (Vec3){size1, 0, 0};
+            verts[2] = (Vec3){size1, size2, 0};
+            verts[3] = (Vec3){0, size2, 0};
             break;
     }
 
-    Vec3 verts[4] = {v0, v1, v2, v3};
+    float cos_a = cosf(angle);
+    float sin_a = sinf(angle);
 
     for (int i = 0; i < 4; i++)
     {
         float x = verts[i].x;
         float z = verts[i].z;
-        verts[i].x = x * cosf(angle) - z * sinf(angle);
-        verts[i].z = x * sinf(angle) + z * cosf(angle);
+        verts[i].x = x * cos_a - z * sin_a;
+        verts[i].z = x * sin_a + z * cos_a;
 
         verts[i].y += pos.y;
         verts[i].x += pos.x;
@@ -148,8 +245,19 @@ static inline void place_rect( buffer *buf, Olivec_Canvas oc, Vec3 pos, float si
         verts[1] = verts[3];
         verts[3] = tmp;
     }
+}
 
-    place_rect_help(buf, oc, verts[0], verts[1], verts[2], verts[3], c, light, cam);
+static inline void place_rect(Raster *rs, Vec3 pos, float size1, float size2, float angle, uint32_t c, RectType type, bool cull_other_side, Light light, const View *view)
+{
+    Vec3 verts[4];
+    rect_corners(pos, size1, size2, angle, type, cull_other_side, verts);
+
+    // Shared corners of the quad go through the view transform once
+    Vec3 cam_verts[4];
+    view_transform(view, verts, cam_verts, 4);
+
+    Vec3 normal = calculate_triangle_normal(verts);
+    place_rect_help(rs, verts, cam_verts, normal, c, light, view, NULL, NULL, NULL);
 }
 
 static inline void create_background(Olivec_Canvas oc, uint32_t c)
@@ -157,34 +265,114 @@ static inline void create_background(Olivec_Canvas oc, uint32_t c)
     olivec_fill(oc, c);
 }
 
-static inline void create_floor(buffer *buf,Olivec_Canvas oc,int tile_count_x, int tile_count_z, float tile_size, float floor_y, uint32_t c1, uint32_t c2, Light light, Camera cam)
+static inline void mesh_reserve(Mesh *mesh, int quads)
+{
+    if (quads <= mesh->quad_capacity) return;
+    int capacity = mesh->quad_capacity ? mesh->quad_capacity : 16;
+    while (capacity < quads) capacity *= 2;
+    mesh->verts = (Vec3 *)realloc(mesh->verts, sizeof(Vec3) * 4 * capacity);
+    mesh->cam_verts = (Vec3 *)realloc(mesh->cam_verts, sizeof(Vec3) * 4 * capacity);
+    mesh->bounds = (Vec3 *)realloc(mesh->bounds, sizeof(Vec3) * 2 * capacity);
+    mesh->normals = (Vec3 *)realloc(mesh->normals, sizeof(Vec3) * capacity);
+    mesh->colors = (uint32_t *)realloc(mesh->colors, sizeof(uint32_t) * capacity);
+    mesh->textures = (int *)realloc(mesh->textures, sizeof(int) * capacity);
+    mesh->quad_capacity = capacity;
+}
+
+static inline void mesh_free(Mesh *mesh)
+{
+    free(mesh->verts);
+    free(mesh->cam_verts);
+    free(mesh->bounds);
+    free(mesh->normals);
+    free(mesh->colors);
+    free(mesh->textures);
+    *mesh = (Mesh){0};
+}
+
+static inline void mesh_set_rect(Mesh *mesh, int q, Vec3 pos, float size1, float size2, float angle, uint32_t c, int texture, RectType type, bool cull_other_side)
+{
+    Vec3 *verts = &mesh->verts[q * 4];
+    rect_corners(pos, size1, size2, angle, type, cull_other_side, verts);
+    mesh->normals[q] = calculate_triangle_normal(verts);
+    mesh->colors[q] = c;
+    mesh->textures[q] = texture;
+
+    Vec3 lo = verts[0], hi = verts[0];
+    for (int i = 1; i < 4; i++)
+    {
+        lo = (Vec3){ fminf(lo.x, verts[i].x), fminf(lo.y, verts[i].y), fminf(lo.z, verts[i].z) };
+        hi = (Vec3){ fmaxf(hi.x, verts[i].x), fmaxf(hi.y, verts[i].y), fmaxf(hi.z, verts[i].z) };
+    }
+    mesh->bounds[q * 2] = lo;
+    mesh->bounds[q * 2 + 1] = hi;
+}
+
+// Streams the baked quads listed in quads (all of them when NULL): quads whose
+// bounds miss the frustum are dropped before any per-vertex work, the rest
+// are transformed and set up. Lit colors come from baked (LIGHTMAP_SAMPLES
+// per quad) when it is not NULL; point lights from bins, gathered per quad
+// from its bounds, when that is not NULL. Quads with a texture index look
+// it up in textures.
+static inline void mesh_render(Mesh *mesh, const int *quads, int count, Raster *rs, Light light, const View *view, const uint32_t *baked, LightBins *bins, const Texture *textures)
 {
-    for (int tz = 0; tz < tile_count_z; tz++)
+    int reaching[LIGHTS_MAX_PER_WALL];
+    for (int i = 0; i < count; i++)
     {
-        for (int tx = -tile_count_x / 2; tx < tile_count_x / 2; tx++)
+        int q = quads ? quads[i] : i;
+        rs->stats.objects_tested++;
+        if (aabb_outside_planes(view->frustum, 6, mesh->bounds[q * 2], mesh->bounds[q * 2 + 1]))
+        {
+            rs->stats.objects_culled++;
+            continue;
+        }
+
+        LightList lights = { NULL, reaching, 0 };
+        if (bins)
         {
-            Vec3 pos = {
-                tx * tile_size - 1000, // -1000 so the we dont just see one end of the tiles in the middle of the map
-                // its a made up number lol
-                floor_y,
-                tz * tile_size + 4.0f - 500.0f - 1000
-            };
-            uint32_t color = ((tx + tz) & 1) ? c1 : c2;
-            place_rect(
-                buf,
-                oc,
-                pos,
-                tile_size,
-                tile_size,
-                0.0f,
-                color,
-                FLOOR,
-                false,
-                light,
-                cam
-            );
+            lights.lights = bins->lights;
+            lights.count = lights_gather(bins, mesh->bounds[q * 2], mesh->bounds[q * 2 + 1], reaching);
         }
+
+        TexMap map;
+        if (textures && mesh->textures[q]) map = texmap_quad(&textures[mesh->textures[q] - 1], &mesh->verts[q * 4]);
+
+        view_transform(view, &mesh->verts[q * 4], &mesh->cam_verts[q * 4], 4);
+        place_rect_help(rs,
+            &mesh->verts[q * 4],
+            &mesh->cam_verts[q * 4],
+            mesh->normals[q],
+            mesh->colors[q],
+            light, view,
+            baked ? &baked[q * LIGHTMAP_SAMPLES] : NULL,
+            lights.count ? &lights : NULL,
+            (textures && mesh->textures[q]) ? &map : NULL);
     }
 }
 
+// texture, when not NULL, repeats once per tile
+static inline void create_floor(Raster *rs, int tile_count_x, int tile_count_z, float tile_size, float floor_y, uint32_t c1, uint32_t c2, Light light, const View *view, LightBins *lights, const Texture *texture)
+{
+    Ground ground = {
+        .view = *view,
+        .light = light,
+        .floor_y = floor_y,
+        .tile_size = tile_size,
+        // -1000 so the we dont just see one end of the tiles in the middle of the map
+        // its a made up number lol
+        .origin_x = -(tile_count_x / 2) * tile_size - 1000,
+        .origin_z = 4.0f - 500.0f - 1000,
+        .tiles_x = tile_count_x,
+        .tiles_z = tile_count_z,
+        .c1 = c1,
+        .c2 = c2,
+        .shadow = (light.shadow && light.shadow->valid) ? light.shadow : NULL,
+        .lights = (lights && lights->light_count) ? lights : NULL,
+        .texture = texture
+    };
+    if (ground.lights)
+        lights_bin_floor(lights, ground.origin_x, ground.origin_z, tile_size, tile_count_x, tile_count_z, floor_y);
+    raster_set_ground(rs, ground);
+}
+
 #endif // TRIANGLE_H
@@ -49,55 +49,254 @@ static inline Vec3 light_space(Vec3 world, Light light)
     return result;
 }
 
-static inline int is_back_facing(Vec3 tri[3], Camera cam)
+// Shadow map lookups; shadow.h renders the map. Receivers are moved
+// SHADOW_BIAS toward the light and walls also SHADOW_NORMAL_OFFSET off their
+// surface, so nothing shadows itself. Depths past every caster clamp to
+// SHADOW_FAR_DEPTH, just in front of empty texels.
+#define SHADOW_NEAR 1.0f
+#define SHADOW_BIAS 1.0f
+#define SHADOW_NORMAL_OFFSET 2.0f
+#define SHADOW_FAR_DEPTH 0.999f
+
+// A point in shadow map texels: face, position within it and stored depth
+typedef struct
+{
+    int face;
+    float u;
+    float v;
+    float depth;
+}
+ShadowCoord;
+
+// Projects d, relative to the map origin, into the given face with its
+// depth bias units closer to the light
+static inline ShadowCoord shadow_face_coord(const ShadowMap *m, int face, Vec3 d, float bias)
+{
+    const Vec3 *axis = m->axis[face];
+    float x = vec3_dot(d, axis[0]);
+    float y = vec3_dot(d, axis[1]);
+    float z = vec3_dot(d, axis[2]);
+    float half = 0.5f * m->size;
+    ShadowCoord c = { face, 0.0f, 0.0f, 0.0f };
+    if (m->perspective)
+    {
+        float inv = 1.0f / z;
+        c.u = x * inv * m->scale + half;
+        c.v = y * inv * m->scale + half;
+        c.depth = 1.0f - SHADOW_NEAR / (z - bias);
+    }
+    else
+    {
+        c.u = x * m->scale + half;
+        c.v = y * m->scale + half;
+        c.depth = fminf((z - bias) * m->depth_scale + 0.5f, SHADOW_FAR_DEPTH);
+    }
+    return c;
+}
+
+// Like shadow_face_coord, picking the cube face d falls in. face is -1 where
+// the map has nothing to say, above a point light or right next to it.
+static inline ShadowCoord shadow_coord(const ShadowMap *m, Vec3 d, float bias)
+{
+    if (!m->perspective) return shadow_face_coord(m, 0, d, bias);
+
+    float ax = fabsf(d.x);
+    float az = fabsf(d.z);
+    int face;
+    float z;
+    if (d.y >= ax && d.y >= az) { face = 0; z = d.y; }
+    else if (ax >= az)          { face = d.x > 0.0f ? 1 : 2; z = ax; }
+    else                        { face = d.z > 0.0f ? 3 : 4; z = az; }
+    if (-d.y > z || z - bias < SHADOW_NEAR) return (ShadowCoord){ -1, 0.0f, 0.0f, 0.0f };
+    return shadow_face_coord(m, face, d, bias);
+}
+
+// 1 when depth is in front of texel (x, y) of face; coordinates clamp to
+// the face, whose border texels are empty for the orthographic map
+static inline int shadow_lit(const ShadowMap *m, int face, int x, int y, float depth)
+{
+    int last = m->size - 1;
+    x = x < 0 ? 0 : (x > last ? last : x);
+    y = y < 0 ? 0 : (y > last ? last : y);
+    return depth <= m->target.shadow_depth[(face * m->size + y) * m->size + x];
+}
+
+// Fraction of the light reaching p: percentage-closer filtering over the
+// 2x2 texels around p, weighted bilinearly
+static inline float shadow_visibility(const ShadowMap *m, Vec3 p)
+{
+    ShadowCoord c = shadow_coord(m, vec3_sub(p, m->origin), SHADOW_BIAS);
+    if (c.face < 0) return 1.0f;
+    float u = clamp(-1.0f, c.u - 0.5f, (float)m->size);
+    float v = clamp(-1.0f, c.v - 0.5f, (float)m->size);
+    float fu = floorf(u);
+    float fv = floorf(v);
+    int x = (int)fu;
+    int y = (int)fv;
+    float top = lerp(shadow_lit(m, c.face, x, y, c.depth), shadow_lit(m, c.face, x + 1, y, c.depth), u - fu);
+    float bottom = lerp(shadow_lit(m, c.face, x, y + 1, c.depth), shadow_lit(m, c.face, x + 1, y + 1, c.depth), u - fu);
+    return lerp(top, bottom, v - fv);
+}
+
+static inline int is_back_facing(Vec3 tri[3], Vec3 eye)
 {
     Vec3 e1 = vec3_sub(tri[1], tri[0]);
     Vec3 e2 = vec3_sub(tri[2], tri[0]);
     Vec3 n = vec3_cross(e1, e2);
 
-    Vec3 cam_pos = { cam.pos_x, cam.pos_y, cam.pos_z };
-    Vec3 dir = vec3_sub(cam_pos, tri[0]);
+    Vec3 dir = vec3_sub(eye, tri[0]);
     float d = vec3_dot(n, dir);
     return d <= 0.0f;
 }
 
-static inline Vec3 project(Vec3 point, Camera cam, int screen_w, int screen_h)
+// Yaw around y by angle_x, then pitch around x by angle_y, folded into one matrix
+static inline View view_create(Camera cam, int screen_w, int screen_h)
 {
     float fov = 60.0f * M_PI / 180.0f;
-    float focal_length = screen_h / (2.0f * tanf(fov / 2.0f));
-
-    Vec3 rel = { point.x - cam.pos_x, point.y - cam.pos_y, point.z - cam.pos_z };
 
     float cos_x = cosf(cam.angle_x);
     float sin_x = sinf(cam.angle_x);
     float cos_y = cosf(cam.angle_y);
     float sin_y = sinf(cam.angle_y);
 
-    float tmp_x = rel.x * cos_x - rel.z * sin_x;
-    float tmp_z = rel.x * sin_x + rel.z * cos_x;
-    rel.x = tmp_x;
-    rel.z = tmp_z;
+    Vec3 right   = {  cos_x,          0.0f,  -sin_x         };
+    Vec3 up      = { -sin_y * sin_x,  cos_y, -sin_y * cos_x };
+    Vec3 forward = {  cos_y * sin_x,  sin_y,  cos_y * cos_x };
+    Vec3 eye = { cam.pos_x, cam.pos_y, cam.pos_z };
+
+    View view;
+    Vec3 rows[3] = { right, up, forward };
+    for (int i = 0; i < 3; i++)
+    {
+        view.m[i][0] = rows[i].x;
+        view.m[i][1] = rows[i].y;
+        view.m[i][2] = rows[i].z;
+        view.m[i][3] = -vec3_dot(rows[i], eye);
+    }
+    view.eye = eye;
+    view.focal_length = screen_h / (2.0f * tanf(fov / 2.0f));
+    view.center_x = screen_w * 0.5f;
+    view.center_y = screen_h * 0.5f;
+
+    // Near plane, then x and y kept within the guard band around the screen:
+    // sx >= -g  <=>  x*f + (cx + g)*z >= 0, and likewise for the other sides.
+    // The far plane last, so depth never leaves [0, 1].
+    float f = view.focal_length;
+    float gx0 = view.center_x + g_guard_band;
+    float gx1 = screen_w - view.center_x + g_guard_band;
+    float gy0 = view.center_y + g_guard_band;
+    float gy1 = screen_h - view.center_y + g_guard_band;
+    view.clip[0] = (Plane){ {  0.0f, 0.0f, 1.0f }, Z_NEAR };
+    view.clip[1] = (Plane){ {  f,    0.0f, gx0  }, 0.0f };
+    view.clip[2] = (Plane){ { -f,    0.0f, gx1  }, 0.0f };
+    view.clip[3] = (Plane){ {  0.0f, f,    gy0  }, 0.0f };
+    view.clip[4] = (Plane){ {  0.0f, -f,   gy1  }, 0.0f };
+    view.clip[5] = (Plane){ {  0.0f, 0.0f, -1.0f }, -Z_FAR };
+
+    // Culling frustum at the exact screen edges, moved to world space:
+    // n.(R p + t) - d  =  (R^T n).p - (d - n.t)
+    Plane cam_planes[6] = {
+        { {  0.0f, 0.0f,  1.0f          }, Z_NEAR },
+        { {  0.0f, 0.0f, -1.0f          }, -Z_FAR },
+        { {  f,    0.0f,  view.center_x }, 0.0f },
+        { { -f,    0.0f,  screen_w - view.center_x }, 0.0f },
+        { {  0.0f, f,     view.center_y }, 0.0f },
+        { {  0.0f, -f,    screen_h - view.center_y }, 0.0f },
+    };
+    for (int i = 0; i < 6; i++)
+    {
+        Vec3 n = cam_planes[i].normal;
+        Vec3 t = { view.m[0][3], view.m[1][3], view.m[2][3] };
+        Vec3 wn = {
+            rows[0].x * n.x + rows[1].x * n.y + rows[2].x * n.z,
+            rows[0].y * n.x + rows[1].y * n.y + rows[2].y * n.z,
+            rows[0].z * n.x + rows[1].z * n.y + rows[2].z * n.z
+        };
+        view.frustum[i] = (Plane){ wn, cam_planes[i].distance - vec3_dot(n, t) };
+    }
+
+    // The frustum is the hull of the eye and its far corners
+    view.frustum_lo = eye;
+    view.frustum_hi = eye;
+    for (int i = 0; i < 4; i++)
+    {
+        float sx = (i & 1) ? (float)screen_w : 0.0f;
+        float sy = (i & 2) ? (float)screen_h : 0.0f;
+        Vec3 p = { (sx - view.center_x) / f * Z_FAR, (sy - view.center_y) / f * Z_FAR, Z_FAR };
+        Vec3 w = vec3_add(eye, vec3_add(vec3_scale(right, p.x), vec3_add(vec3_scale(up, p.y), vec3_scale(forward, p.z))));
+        view.frustum_lo = (Vec3){ fminf(view.frustum_lo.x, w.x), fminf(view.frustum_lo.y, w.y), fminf(view.frustum_lo.z, w.z) };
+        view.frustum_hi = (Vec3){ fmaxf(view.frustum_hi.x, w.x), fmaxf(view.frustum_hi.y, w.y), fmaxf(view.frustum_hi.z, w.z) };
+    }
+    return view;
+}
 
-    float tmp_y = rel.y * cos_y - rel.z * sin_y;
-    tmp_z = rel.y * sin_y + rel.z * cos_y;
-    rel.y = tmp_y;
-    rel.z = tmp_z;
+// Inverse of view_to_camera; the view rotation is orthonormal
+static inline Vec3 view_to_world(const View *view, Vec3 p)
+{
+    const float (*m)[4] = view->m;
+    Vec3 result = {
+        m[0][0] * p.x + m[1][0] * p.y + m[2][0] * p.z + view->eye.x,
+        m[0][1] * p.x + m[1][1] * p.y + m[2][1] * p.z + view->eye.y,
+        m[0][2] * p.x + m[1][2] * p.y + m[2][2] * p.z + view->eye.z
+    };
+    return result;
+}
 
-    if (rel.z < Z_NEAR) rel.z = Z_NEAR;
+static inline Vec3 view_to_camera(const View *view, Vec3 p)
+{
+    const float (*m)[4] = view->m;
+    Vec3 result = {
+        m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+        m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+        m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]
+    };
+    return result;
+}
+
+// Batched world->camera transform, one pass over a contiguous vertex array
+static inline void view_transform(const View *view, const Vec3 *in, Vec3 *out, int count)
+{
+    for (int i = 0; i < count; i++)
+        out[i] = view_to_camera(view, in[i]);
+}
 
+// Depth buffer value of view depth z: 0 at Z_NEAR, 1 at Z_FAR. It is
+// linear in 1/z, so interpolating it across the screen is exact even for
+// triangles spanning most of the depth range.
+static inline float view_depth(float z)
+{
+    return (1.0f / Z_NEAR - 1.0f / z) * (1.0f / (1.0f / Z_NEAR - 1.0f / Z_FAR));
+}
+
+// 1/z back from a view_depth value
+static inline float view_depth_inv_z(float depth)
+{
+    return 1.0f / Z_NEAR - depth * (1.0f / Z_NEAR - 1.0f / Z_FAR);
+}
+
+// Expects a point already clipped to the near plane
+static inline Vec3 project(Vec3 rel, const View *view)
+{
     float inv_z = 1.0f / rel.z;
-    float sx = (rel.x * focal_length * inv_z) + screen_w * 0.5f;
-    float sy = (rel.y * focal_length * inv_z) + screen_h * 0.5f;
-    float sz = (rel.z - Z_NEAR) / (Z_FAR - Z_NEAR);
+    float sx = (rel.x * view->focal_length * inv_z) + view->center_x;
+    float sy = (rel.y * view->focal_length * inv_z) + view->center_y;
+    float sz = view_depth(rel.z);
 
     Vec3 result = { sx, sy, sz };
     return result;
 }
 
+// Share of a color left after fog at distance, as apply_fog blends it
+static inline float fog_keep(float distance)
+{
+    if (!g_fog_active || distance <= g_fog_start) return 1.0f;
+    if (distance >= g_fog_end) return 0.0f;
+    return 1.0f - (distance - g_fog_start) / (g_fog_end - g_fog_start);
+}
+
 static inline uint32_t apply_fog(uint32_t original_color, float distance)
 {
-    if (distance <= g_fog_start) return original_color;
-#ifdef g_fog_active
+    if (!g_fog_active || distance <= g_fog_start) return original_color;
     if (distance >= g_fog_end) return g_fog_color;
 
     float fog_factor = (distance - g_fog_start) / (g_fog_end - g_fog_start);
@@ -120,30 +319,31 @@ static inline uint32_t apply_fog(uint32_t original_color, float distance)
 
     uint32_t result = (0xFF << 24) | (nr << 16) | (ng << 8) | nb;
     return result;
-#endif
-    return original_color;
 }
 
-static inline uint32_t apply_lighting(uint32_t base_color, Vec3 surface_normal, Vec3 surface_position, Light light)
+// Fog amount (0..256) at FOG_LUT_SIZE distances from 0 to g_fog_end, for
+// per-pixel fog; the table coordinate is distance * FOG_LUT_SCALE
+#define FOG_LUT_SIZE 256
+#define FOG_LUT_SCALE ((FOG_LUT_SIZE - 1) / g_fog_end)
+
+static int32_t g_fog_lut[FOG_LUT_SIZE];
+
+static inline void fog_lut_init(void)
 {
-#ifdef g_light_active
-    Vec3 light_dir;
-    if (light.is_directional)
+    for (int i = 0; i < FOG_LUT_SIZE; i++)
     {
-        light_dir = vec3_neg(light.direction);
+        float distance = i / FOG_LUT_SCALE;
+        float fog_factor = (distance - g_fog_start) / (g_fog_end - g_fog_start);
+        fog_factor = fmaxf(0.0f, fminf(1.0f, fog_factor));
+        g_fog_lut[i] = (int32_t)(fog_factor * 256);
     }
-    else
-    {
-        light_dir = vec3_sub(light.position, surface_position);
-    }
-    light_dir = vec3_normalize(light_dir);
-
-    float diffuse = vec3_dot(surface_normal, light_dir);
-    diffuse = fmaxf(0.0f, diffuse);
+}
 
-    float ambient = 0.2f;
-    float intensity = ambient + diffuse * light.intensity * (1.0f - ambient);
+#define LIGHT_AMBIENT 0.2f
 
+// base_color scaled by intensity and tinted by the light's color
+static inline uint32_t light_color(uint32_t base_color, float intensity, Light light)
+{
     uint8_t r = ((base_color >> 16) & 0xFF);
     uint8_t g = ((base_color >> 8) & 0xFF);
     uint8_t b = (base_color & 0xFF);
@@ -162,13 +362,50 @@ static inline uint32_t apply_lighting(uint32_t base_color, Vec3 surface_normal,
 
     uint32_t result = 0xFF000000 | (r << 16) | (g << 8) | b;
     return result;
-#endif
-    return base_color;
 }
 
-static inline void place_text(Olivec_Canvas oc, char text[2048])
+// Unit vector from the surface towards the light
+static inline Vec3 light_direction(Vec3 surface_position, Light light)
 {
-    olivec_text(oc, text, 10, 10, olivec_default_font, 2, 0xFFFFFFFF);
+    Vec3 light_dir;
+    if (light.is_directional)
+    {
+        light_dir = vec3_neg(light.direction);
+    }
+    else
+    {
+        light_dir = vec3_sub(light.position, surface_position);
+    }
+    return vec3_normalize(light_dir);
+}
+
+static inline uint32_t apply_lighting(uint32_t base_color, Vec3 surface_normal, Vec3 surface_position, Light light)
+{
+    if (!g_light_active) return base_color;
+
+    Vec3 light_dir = light_direction(surface_position, light);
+    float diffuse = vec3_dot(surface_normal, light_dir);
+    diffuse = fmaxf(0.0f, diffuse);
+    if (diffuse > 0.0f && light.shadow && light.shadow->valid)
+    {
+        Vec3 p = vec3_add(surface_position, vec3_scale(surface_normal, SHADOW_NORMAL_OFFSET));
+        diffuse *= shadow_visibility(light.shadow, p);
+    }
+
+    float intensity = LIGHT_AMBIENT + diffuse * light.intensity * (1.0f - LIGHT_AMBIENT);
+    return light_color(base_color, intensity, light);
+}
+
+// Per-channel weighted sum of three colors, weights summing to 1
+static inline uint32_t color_blend3(const uint32_t c[3], float w0, float w1, float w2)
+{
+    uint32_t result = 0xFF000000;
+    for (int shift = 0; shift < 24; shift += 8)
+    {
+        float v = ((c[0] >> shift) & 0xFF) * w0 + ((c[1] >> shift) & 0xFF) * w1 + ((c[2] >> shift) & 0xFF) * w2;
+        result |= (uint32_t)clamp(0.0f, v + 0.5f, 255.0f) << shift;
+    }
+    return result;
 }
 
 static inline void update_camera(